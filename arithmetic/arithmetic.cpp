@@ -55,7 +55,7 @@ namespace arithmetic
             gwset_information_only(gwdata());
     }
 
-    void GWState::setup(uint64_t k, uint64_t b, int n, int c)
+    void GWState::setup(uint64_t k, uint64_t b, int n, int c, const Giant* value)
     {
         init();
         if (k >= (1ULL << 51) || b >= (1ULL << 32))
@@ -66,10 +66,15 @@ namespace arithmetic
         if (gwdata()->GENERAL_MOD)
             bit_length /= 2;
         giants.reset(GiantsArithmetic::alloc_gwgiants(gwdata(), (bit_length >> 5) + 10));
-        N.reset(new Giant());
-        Giant tmp;
-        tmp.arithmetic().init((uint32_t*)&k, 2, tmp);
-        *N = tmp*power(std::move(*N = (uint32_t)b), n) + c;
+        if (value != nullptr)
+            N.reset(new Giant(*value));
+        else
+        {
+            N.reset(new Giant());
+            Giant tmp;
+            tmp.arithmetic().init((uint32_t*)&k, 2, tmp);
+            *N = tmp*power(std::move(*N = (uint32_t)b), n) + c;
+        }
         if (gwdata()->GENERAL_MOD)
             bit_length = N->bitlen();
         fingerprint = *N%3417905339UL;
@@ -122,6 +127,11 @@ namespace arithmetic
         fft_length = gwfftlen(gwdata());
     }
 
+    GWState::~GWState()
+    {
+        done();
+    }
+
     void GWState::clone(GWState& state)
     {
         if (N)
@@ -135,49 +145,121 @@ namespace arithmetic
         fingerprint = state.fingerprint;
         fft_description = state.fft_description;
         fft_length = state.fft_length;
-        mod_gwstate.reset();
+        mod_barrett.reset();
+        // The cloned handle keeps the addin constants of the parent.
+        _addin = state._addin;
+        _postaddin = state._postaddin;
     }
 
     void GWState::done()
     {
-        mod_gwstate.reset();
+        mod_barrett.reset();
         N.reset();
         giants.reset();
         fft_description.clear();
         fft_length = 0;
         gwdone(&handle);
         gwinit(&handle);
+        _addin = 0;
+        _postaddin = 0;
         convert_factor = NULL;
     }
 
+    GWBarrett& GWState::barrett()
+    {
+        if (!mod_barrett)
+            mod_barrett.reset(new GWBarrett(*this));
+        return *mod_barrett;
+    }
+
     void GWState::mod(arithmetic::Giant& a, arithmetic::Giant& res)
     {
-        if (!mod_gwstate)
+        barrett().mod(a, res);
+    }
+
+    void GWState::mod(const std::vector<arithmetic::Giant*>& values)
+    {
+        barrett().mod(values);
+    }
+
+    double GWState::ops()
+    {
+        return gw_get_fft_count(gwdata())*(gwdata()->GENERAL_MMGW_MOD ? 1.0/7.5 : gwdata()->GENERAL_MOD ? 1.0/6 : 1.0/2);
+    }
+
+    GWBarrett::GWBarrett(const Giant& N, int max_bitlen, int thread_count) : _N(N), _thread_count(thread_count)
+    {
+        _bitlen = _N.bitlen();
+        _max_bitlen = max_bitlen > 2*_bitlen ? max_bitlen : 2*_bitlen;
+    }
+
+    GWBarrett::GWBarrett(GWState& state) : _N(*state.N), _thread_count(state.thread_count)
+    {
+        _bitlen = _N.bitlen();
+        _max_bitlen = 2*_bitlen;
+        if (state.need_mod() && _bitlen + state.known_factors.bitlen() > _max_bitlen)
+            _max_bitlen = _bitlen + state.known_factors.bitlen();
+    }
+
+    void GWBarrett::init()
+    {
+        // q = ((a >> (bitlen - 1))*mu) >> (max_bitlen - bitlen + 1) underestimates a/N by at most 3
+        _state.thread_count = _thread_count;
+        _state.setup(2*(_max_bitlen - _bitlen + 2) + 32);
+        _gw.reset(new GWArithmetic(_state));
+        _reciprocal.reset(new GWNum(*_gw));
+        _modulus.reset(new GWNum(*_gw));
+        _X.reset(new GWNum(*_gw));
+        Giant mu;
+        mu = 1;
+        mu <<= _max_bitlen;
+        mu /= _N;
+        *_reciprocal = mu;
+        _gw->fft(*_reciprocal, *_reciprocal);
+        *_modulus = _N;
+        _gw->fft(*_modulus, *_modulus);
+    }
+
+    void GWBarrett::reduce(Giant& a, Giant& res)
+    {
+        if (!_gw)
+            init();
+        _q = a >> (_bitlen - 1);
+        *_X = _q;
+        _gw->mul(*_X, *_reciprocal, *_X, 0);
+        _q = *_X;
+        _q >>= _max_bitlen - _bitlen + 1;
+        *_X = _q;
+        _gw->mul(*_X, *_modulus, *_X, 0);
+        _q = *_X;
+        res = a;
+        res -= _q;
+        while (res >= _N)
+            res -= _N;
+    }
+
+    void GWBarrett::mod(Giant& a, Giant& res)
+    {
+        if (a < 0 || a.bitlen() > _max_bitlen)
         {
-            mod_gwstate.reset(new GWState());
-            mod_gwstate->force_mod_type = 2;
-            if (gwdata()->GENERAL_MOD)
-                mod_gwstate->setup(square(*N));
-            else
-                mod_gwstate->setup(*N);
+            res = a%_N;
+            if (res < 0)
+                res += _N;
         }
-
-        GWArithmetic gw(*mod_gwstate);
-        GWNum X(gw);
-        if (known_factors > *N)
+        else if (a.bitlen() <= _bitlen)
         {
-            mod_gwstate->mod(a, res);
-            X = res;
+            res = a;
+            if (res >= _N)
+                res -= _N;
         }
         else
-            X = a;
-        gw.fft(X, X);
-        res = X;
+            reduce(a, res);
     }
 
-    double GWState::ops()
+    void GWBarrett::mod(const std::vector<Giant*>& values)
     {
-        return gw_get_fft_count(gwdata())*(gwdata()->GENERAL_MMGW_MOD ? 1.0/7.5 : gwdata()->GENERAL_MOD ? 1.0/6 : 1.0/2);
+        for (auto it = values.begin(); it != values.end(); it++)
+            mod(**it, **it);
     }
 
     GWArithmetic::GWArithmetic(GWState& state) : _state(state)
@@ -10,6 +10,8 @@
 
 namespace arithmetic
 {
+    class GWBarrett;
+
     class GWState
     {
     public:
@@ -21,13 +23,10 @@ namespace arithmetic
         {
             clone(state);
         }
-        ~GWState()
-        {
-            done();
-        }
+        ~GWState();
 
         void init();
-        void setup(uint64_t k, uint64_t b, int n, int c);
+        void setup(uint64_t k, uint64_t b, int n, int c, const Giant* value = nullptr);
         void setup(const Giant& g);
         void setup(int bitlen);
         void clone(GWState& state);
@@ -35,6 +34,8 @@ namespace arithmetic
 
         bool need_mod() { return !known_factors.empty() && known_factors > 1; }
         void mod(arithmetic::Giant& a, arithmetic::Giant& res);
+        void mod(const std::vector<arithmetic::Giant*>& values);
+        GWBarrett& barrett();
 
         gwhandle* gwdata() { return &handle; }
         double ops();
@@ -74,7 +75,7 @@ namespace arithmetic
         std::string fft_description;
         int fft_length;
         int bit_length;
-        std::unique_ptr<arithmetic::GWState> mod_gwstate;
+        std::unique_ptr<GWBarrett> mod_barrett;
         int32_t _addin = 0;
         int32_t _postaddin = 0;
     };
@@ -352,6 +353,38 @@ namespace arithmetic
         GWNum& operator = (GWNum&& a) noexcept override { *this = a; return *this; }
         //operator GWNum&&() = delete; // No effect, just a remainder
     };
+
+    // Barrett reduction of Giants modulo N using a persistent FFT setup without modulus.
+    // Accepts inputs up to max_bitlen bits, so residues modulo N*known_factors are reduced in one pass.
+    class GWBarrett
+    {
+    public:
+        GWBarrett(const Giant& N, int max_bitlen, int thread_count = 1);
+        GWBarrett(GWState& state);
+
+        void mod(Giant& a, Giant& res);
+        void mod(const std::vector<Giant*>& values);
+
+        const Giant& N() { return _N; }
+        int max_bitlen() { return _max_bitlen; }
+        bool initialized() { return (bool)_gw; }
+
+    private:
+        void init();
+        void reduce(Giant& a, Giant& res);
+
+    private:
+        Giant _N;
+        int _bitlen;
+        int _max_bitlen;
+        int _thread_count = 1;
+        GWState _state;
+        std::unique_ptr<GWArithmetic> _gw;
+        std::unique_ptr<GWNum> _reciprocal;
+        std::unique_ptr<GWNum> _modulus;
+        std::unique_ptr<GWNum> _X;
+        Giant _q;
+    };
 }
 
 int gwconvert(
@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <cmath>
 #include <immintrin.h>
 #include "cpuid.h"
 #include "gwnum.h"
@@ -289,7 +290,7 @@ namespace arithmetic
         mul(a, W, naf_w, res);
     }
 
-    void EdwardsArithmetic::mul(EdPoint& a, int W, std::vector<int16_t>& naf_w, EdPoint& res)
+    void EdwardsArithmetic::mul(EdPoint& a, int W, const std::vector<int16_t>& naf_w, EdPoint& res)
     {
         int i, j;
 
@@ -457,10 +458,11 @@ namespace arithmetic
         GWNum y = x8*(t*(t + 50) - 104 - square(s)*(2*s - 27))/((t - 2 + 3*s)*(t + 16 + s));
 
         Giant gx, gy, gx8, gisdx8;
-        (gx = x) %= gw.N();
-        (gy = y) %= gw.N();
-        (gx8 = x8) %= gw.N();
-        (gisdx8 = isdx8) %= gw.N();
+        gx = x;
+        gy = y;
+        gx8 = x8;
+        gisdx8 = isdx8;
+        gw.state().mod({&gx, &gy, &gx8, &gisdx8});
         Giant n1 = gw.N() - 1;
         Giant nx8 = gw.N() - gx8;
         Giant nisdx8 = gw.N() - gisdx8;
@@ -620,6 +622,225 @@ namespace arithmetic
             this->T.reset();
     }
 
+    EdPoint EdwardsArithmetic::from_small(const SmallCurve& curve, GWNum* ed_d)
+    {
+        return from_small(curve.xa, curve.xb, curve.ya, curve.yb, ed_d);
+    }
+
+    namespace
+    {
+        int64_t gcd64(int64_t a, int64_t b)
+        {
+            a = a < 0 ? -a : a;
+            b = b < 0 ? -b : b;
+            while (b != 0)
+            {
+                int64_t t = a%b;
+                a = b;
+                b = t;
+            }
+            return a;
+        }
+
+        bool is_square(int64_t a, int64_t& root)
+        {
+            if (a < 0)
+                return false;
+            root = (int64_t)std::sqrt((double)a);
+            while (root*root > a)
+                root--;
+            while ((root + 1)*(root + 1) <= a)
+                root++;
+            return root*root == a;
+        }
+
+        uint64_t modp(int64_t a, uint64_t p)
+        {
+            int64_t res = a%(int64_t)p;
+            return res < 0 ? res + p : res;
+        }
+
+        uint64_t invmod(uint64_t a, uint64_t p)
+        {
+            uint64_t res = 1;
+            for (uint64_t e = p - 2; e != 0; e >>= 1, a = a*a%p)
+                if (e & 1)
+                    res = res*a%p;
+            return res;
+        }
+
+        // Torsion points over Q have order at most 12 and keep their order modulo a prime of good reduction.
+        // The point is proven non-torsion if its order modulo some prime exceeds 12.
+        bool non_torsion(const SmallCurve& curve)
+        {
+            static const uint64_t primes[] = {1000003, 1000033, 1000037, 1000039};
+            for (uint64_t p : primes)
+            {
+                uint64_t d_den = modp(curve.d_den, p);
+                uint64_t xb = modp(curve.xb, p);
+                uint64_t yb = modp(curve.yb, p);
+                if (d_den == 0 || xb == 0 || yb == 0)
+                    continue;
+                uint64_t d = modp(curve.d_num, p)*invmod(d_den, p)%p;
+                if (d == 0 || d == 1)
+                    continue;
+                uint64_t x = modp(curve.xa, p)*invmod(xb, p)%p;
+                uint64_t y = modp(curve.ya, p)*invmod(yb, p)%p;
+                uint64_t qx = x;
+                uint64_t qy = y;
+                int k;
+                for (k = 1; k <= 12; k++)
+                {
+                    if (qx == 0 && qy == 1)
+                        break;
+                    uint64_t t = d*(qx*x%p)%p*(qy*y%p)%p;
+                    if (t == 1 || t == p - 1)
+                        break;
+                    uint64_t nx = (qx*y + qy*x)%p*invmod(1 + t, p)%p;
+                    uint64_t ny = (qy*y + p*p - qx*x)%p*invmod(1 + p - t, p)%p;
+                    qx = nx;
+                    qy = ny;
+                }
+                if (k > 12)
+                    return true;
+            }
+            return false;
+        }
+    }
+
+    SmallCurveGenerator::SmallCurveGenerator(int family, int32_t max_coefficient, int max_height, int max_parameter) : _family(family), _max_coefficient(max_coefficient), _max_height(max_height), _max_parameter(max_parameter)
+    {
+    }
+
+    int SmallCurveGenerator::torsion(int family)
+    {
+        switch (family)
+        {
+        case TORSION_12:
+            return 12;
+        case TORSION_2x8:
+            return 16;
+        default:
+            return 8;
+        }
+    }
+
+    bool SmallCurveGenerator::parameter(int64_t p, int64_t q, int64_t& d_num, int64_t& d_den)
+    {
+        double up = (double)p;
+        double uq = (double)q;
+        double bound = 4e18;
+        if (_family == TORSION_12)
+        {
+            // u = p/q, the powers of q cancel.
+            double s = up*up + uq*uq;
+            if (std::abs(s*s*s*(up*up + 4*std::abs(up*uq) + uq*uq)) > bound || std::pow(std::abs(up) + uq, 8) > bound)
+                return false;
+            int64_t s2 = p*p + q*q;
+            int64_t m = p - q;
+            int64_t m3 = m*m*m;
+            d_num = s2*s2*s2*(p*p - 4*p*q + q*q);
+            d_den = m3*m3*(p + q)*(p + q);
+        }
+        else if (_family == TORSION_2x8)
+        {
+            // x8 = a/b.
+            int64_t a = p*p + 2*p*q + 2*q*q;
+            int64_t b = p*p - 2*q*q;
+            if (std::pow(std::abs(up) + 2*uq, 8) > bound)
+                return false;
+            d_num = (2*a*a - b*b)*b*b;
+            d_den = a*a*a*a;
+        }
+        else if (_family == TORSION_8)
+        {
+            if (std::pow(std::abs(up) + uq, 4) > bound)
+                return false;
+            d_num = (2*p*p - q*q)*q*q;
+            d_den = p*p*p*p;
+        }
+        else
+        {
+            d_num = p*p;
+            d_den = q*q;
+        }
+        if (d_den == 0 || d_num == 0 || d_num == d_den)
+            return false;
+        int64_t g = gcd64(d_num, d_den);
+        d_num /= g;
+        d_den /= g;
+        if (d_den < 0)
+        {
+            d_num = -d_num;
+            d_den = -d_den;
+        }
+        return (d_num < 0 ? -d_num : d_num) <= _max_coefficient && d_den <= _max_coefficient;
+    }
+
+    bool SmallCurveGenerator::find_point(SmallCurve& res)
+    {
+        for (int h = 2; h <= _max_height; h++)
+            for (int a = 1; a <= h; a++)
+                for (int b = (a < h ? h : 1); b <= h; b++)
+                {
+                    if (a == b || gcd64(a, b) != 1)
+                        continue;
+                    // y^2 = (1 - x^2)/(1 - d*x^2) with x = a/b.
+                    int64_t num = (int64_t)res.d_den*((int64_t)b*b - (int64_t)a*a);
+                    int64_t den = (int64_t)res.d_den*b*b - (int64_t)res.d_num*a*a;
+                    if (num == 0 || den == 0 || (num < 0) != (den < 0))
+                        continue;
+                    int64_t g = gcd64(num, den);
+                    int64_t ya, yb;
+                    if (!is_square(std::abs(num/g), ya) || !is_square(std::abs(den/g), yb))
+                        continue;
+                    res.xa = a;
+                    res.xb = b;
+                    res.ya = (int32_t)ya;
+                    res.yb = (int32_t)yb;
+                    if (non_torsion(res))
+                        return true;
+                }
+        return false;
+    }
+
+    bool SmallCurveGenerator::next(SmallCurve& res)
+    {
+        while (_height <= _max_parameter)
+        {
+            // Parameters of height h are p/h for |p| <= h and +-h/q for q < h.
+            if (_index >= 4*_height - 1)
+            {
+                _height++;
+                _index = 0;
+                continue;
+            }
+            int64_t p, q;
+            if (_index < 2*_height + 1)
+            {
+                q = _height;
+                p = _index - _height;
+            }
+            else
+            {
+                q = (_index - 2*_height - 1)/2 + 1;
+                p = (_index - 2*_height - 1)%2 ? -_height : _height;
+            }
+            _index++;
+            int64_t d_num, d_den;
+            if (gcd64(p, q) != 1 || !parameter(p, q, d_num, d_den))
+                continue;
+            if (!_seen.insert(std::pair<int32_t, int32_t>((int32_t)d_num, (int32_t)d_den)).second)
+                continue;
+            res.d_num = (int32_t)d_num;
+            res.d_den = (int32_t)d_den;
+            res.torsion = torsion(_family);
+            if (find_point(res))
+                return true;
+        }
+        return false;
+    }
+
 #ifdef NESTED_EDWARDS
     extern "C" unsigned long cache_line_offset(
         gwhandle *gwdata,	/* Handle initialized by gwsetup */
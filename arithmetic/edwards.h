@@ -1,10 +1,12 @@
 #pragma once
 
+#include <set>
 #include "group.h"
 
 namespace arithmetic
 {
     class EdPoint;
+    struct SmallCurve;
 
     class EdwardsArithmetic : public GroupArithmetic<EdPoint>
     {
@@ -33,13 +35,14 @@ namespace arithmetic
         virtual void dbl(EdPoint& a, EdPoint& res) override;
         virtual void dbl(EdPoint& a, EdPoint& res, int options);
         virtual void mul(EdPoint& a, Giant& b, EdPoint& res);
-        virtual void mul(EdPoint& a, int W, std::vector<int16_t>& naf_w, EdPoint& res) override;
+        virtual void mul(EdPoint& a, int W, const std::vector<int16_t>& naf_w, EdPoint& res) override;
 
         virtual void normalize(EdPoint& a, int options);
         template <typename Iter>
         void normalize(Iter begin, Iter end, int options);
         EdPoint gen_curve(int seed, GWNum* ed_d);
         EdPoint from_small(int32_t xa, int32_t xb, int32_t ya, int32_t yb, GWNum* ed_d);
+        EdPoint from_small(const SmallCurve& curve, GWNum* ed_d);
         GWNum jinvariant(GWNum& ed_d);
         bool on_curve(EdPoint& a, GWNum& ed_d);
         void d_ratio(EdPoint& a, GWNum& ed_d_a, GWNum& ed_d_b);
@@ -130,6 +133,48 @@ namespace arithmetic
         std::unique_ptr<GWNum> T;
     };
 
+    // Curve x^2 + y^2 = 1 + d*x^2*y^2 with d = d_num/d_den and a non-torsion point (xa/xb, ya/yb), all small integers.
+    struct SmallCurve
+    {
+        int32_t d_num;
+        int32_t d_den;
+        int32_t xa;
+        int32_t xb;
+        int32_t ya;
+        int32_t yb;
+        int torsion;
+    };
+
+    // Enumerates curves of a torsion family by the height of the family parameter u, skipping curves with d_num or d_den above max_coefficient
+    // and curves without a non-torsion point of height up to max_height. Duplicate values of d are skipped.
+    class SmallCurveGenerator
+    {
+    public:
+        static const int TORSION_12 = 0;    // Z/12, d = (u^2 + 1)^3*(u^2 - 4u + 1)/((u - 1)^6*(u + 1)^2)
+        static const int TORSION_2x8 = 1;   // Z/2 x Z/8, d = (2x8^2 - 1)/x8^4, x8 = (u^2 + 2u + 2)/(u^2 - 2)
+        static const int TORSION_8 = 2;     // Z/8, d = (2u^2 - 1)/u^4
+        static const int TORSION_2x4 = 3;   // Z/2 x Z/4, d = u^2
+
+    public:
+        SmallCurveGenerator(int family = TORSION_12, int32_t max_coefficient = 1 << 20, int max_height = 64, int max_parameter = 256);
+
+        bool next(SmallCurve& res);
+        static int torsion(int family);
+
+    private:
+        bool parameter(int64_t p, int64_t q, int64_t& d_num, int64_t& d_den);
+        bool find_point(SmallCurve& res);
+
+    private:
+        int _family;
+        int32_t _max_coefficient;
+        int _max_height;
+        int _max_parameter;
+        int _height = 1;
+        int _index = 0;
+        std::set<std::pair<int32_t, int32_t>> _seen;
+    };
+
 #ifdef NESTED_EDWARDS
     class NestedEdwardsArithmetic : public EdwardsArithmetic
     {
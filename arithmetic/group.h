@@ -21,7 +21,7 @@ namespace arithmetic
         virtual void neg(Element& a, Element& res) = 0;
         virtual void dbl(Element& a, Element& res) = 0;
 
-        virtual void mul(Element& a, int W, std::vector<int16_t>& naf_w, Element& res)
+        virtual void mul(Element& a, int W, const std::vector<int16_t>& naf_w, Element& res)
         {
             int i, j;
 
@@ -3,6 +3,10 @@
 #include <vector>
 #include <iterator>
 #include <memory>
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace arithmetic
 {
@@ -21,6 +25,68 @@ namespace arithmetic
     int kronecker(uint32_t a, uint32_t b);
     inline int kronecker(int a, int b) { return kronecker((uint32_t)a, (uint32_t)b); }
 
+    inline uint64_t umul128(uint64_t a, uint64_t b, uint64_t& hi)
+    {
+#ifdef _MSC_VER
+        return _umul128(a, b, &hi);
+#else
+        unsigned __int128 res = (unsigned __int128)a*b;
+        hi = (uint64_t)(res >> 64);
+        return (uint64_t)res;
+#endif
+    }
+
+    // Montgomery arithmetic modulo an odd p < 2^63, values are kept in Montgomery form.
+    class Montgomery64
+    {
+    public:
+        Montgomery64() : _p(0), _pinv(0), _one(0), _r2(0) { }
+        Montgomery64(uint64_t p) : _p(p)
+        {
+            uint64_t inv = p;
+            for (int i = 0; i < 5; i++)
+                inv *= 2 - p*inv;
+            _pinv = 0 - inv;
+            _one = (0 - p)%p;
+            _r2 = _one;
+            for (int i = 0; i < 64; i++)
+                _r2 = add(_r2, _r2);
+        }
+
+        uint64_t p() const { return _p; }
+        uint64_t one() const { return _one; }
+        uint64_t to(uint64_t a) const { return mul(a%_p, _r2); }
+        uint64_t from(uint64_t a) const { return reduce(a, 0); }
+
+        uint64_t add(uint64_t a, uint64_t b) const { a += b; return a >= _p ? a - _p : a; }
+        uint64_t sub(uint64_t a, uint64_t b) const { return a >= b ? a - b : a + _p - b; }
+        uint64_t mul(uint64_t a, uint64_t b) const { uint64_t hi; uint64_t lo = umul128(a, b, hi); return reduce(lo, hi); }
+        uint64_t pow(uint64_t a, uint64_t e) const
+        {
+            uint64_t res = _one;
+            for (; e > 0; e >>= 1, a = mul(a, a))
+                if (e & 1)
+                    res = mul(res, a);
+            return res;
+        }
+        uint64_t inv(uint64_t a) const { return pow(a, _p - 2); }
+
+    private:
+        uint64_t reduce(uint64_t lo, uint64_t hi) const
+        {
+            uint64_t mhi;
+            umul128(lo*_pinv, _p, mhi);
+            uint64_t res = hi + mhi + (lo != 0);
+            return res >= _p ? res - _p : res;
+        }
+
+    private:
+        uint64_t _p;
+        uint64_t _pinv;
+        uint64_t _one;
+        uint64_t _r2;
+    };
+
     class PrimeIterator;
 
     class PrimeList
@@ -405,7 +405,7 @@ namespace arithmetic
         mul(a, W, naf_w, res);
     }
 
-    void LucasUVArithmetic::mul(LucasUV& a, int W, std::vector<int16_t>& naf_w, LucasUV& res)
+    void LucasUVArithmetic::mul(LucasUV& a, int W, const std::vector<int16_t>& naf_w, LucasUV& res)
     {
         int i, j;
 
@@ -165,7 +165,7 @@ namespace arithmetic
         virtual void dbl(LucasUV& a, LucasUV& res, int options);
         virtual void dbl_add_small(LucasUV& a, int index, LucasUV& res, int options);
         virtual void mul(LucasUV& a, Giant& b, LucasUV& res);
-        virtual void mul(LucasUV& a, int W, std::vector<int16_t>& naf_w, LucasUV& res) override;
+        virtual void mul(LucasUV& a, int W, const std::vector<int16_t>& naf_w, LucasUV& res) override;
         virtual void optimize(LucasUV& a);
 
         GWArithmetic& gw() { return *_gw; }
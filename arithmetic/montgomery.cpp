@@ -146,6 +146,12 @@ namespace arithmetic
 
     void MontgomeryArithmetic::dbl(EdY& a, EdY& res)
     {
+        // Without normalization the small path pays off only if d_den - d_num fits GWMUL_MULBYCONST.
+        if (small_d() && (!a.Z || abs(_d_den - _d_num) <= gw().state().maxmulbyconst))
+        {
+            dbl_small_d(a, res);
+            return;
+        }
         bool safe1 = square_safe(gw().gwdata(), 1);
         bool safe11 = mul_safe(gw().gwdata(), 1, 1);
 
@@ -179,6 +185,62 @@ namespace arithmetic
         gw().addsub(*res.Z, *res.Y, *res.Z, *res.Y, GWADD_DELAYNORM_IF(safe1));
     }
 
+    void MontgomeryArithmetic::dbl_small_d(EdY& a, EdY& res)
+    {
+        bool safe1 = square_safe(gw().gwdata(), 1);
+        bool safe11 = mul_safe(gw().gwdata(), 1, 1);
+
+        bool normalized = !a.Z;
+        if (!res.Y)
+            res.Y.reset(new GWNum(gw()));
+        if (!res.Z)
+            res.Z.reset(new GWNum(gw()));
+        if (!res.ZpY)
+            res.ZpY.reset(new GWNum(gw()));
+        if (!res.ZmY)
+            res.ZmY.reset(new GWNum(gw()));
+
+        // d = d_num/d_den, both terms are scaled by d_den
+        // t1 = (d_den - d_num)*zz*yy
+        // t2 = (zz - yy)*(d_den*zz - d_num*yy)
+        // y_2 = t1 - t2
+        // z_2 = t1 + t2
+
+        int32_t c = _d_den - _d_num;
+        gw().square(*a.Y, *res.Y, 0); // yy
+        if (!normalized)
+            gw().square(*a.Z, *res.Z, 0); // zz
+        else
+            gw().init(1, *res.Z);
+        gw().sub(*res.Z, *res.Y, *res.ZmY, GWADD_DELAYNORM_IF(safe11)); // zz - yy
+        gw().mul(*res.Y, _d_num, *res.ZpY); // d_num*yy
+        if (normalized)
+        {
+            gw().init(_d_den, *res.Z);
+            gw().sub(*res.Z, *res.ZpY, *res.ZpY, GWADD_DELAYNORM_IF(safe11)); // d_den - d_num*yy
+            gw().mul(*res.ZmY, *res.ZpY, *res.ZmY, GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_STARTNEXTFFT_IF(safe1)); // t2
+            gw().mul(*res.Y, c, *res.Z); // t1
+        }
+        else
+        {
+            if (_d_den != 1)
+            {
+                if (!_tmp)
+                    _tmp.reset(new GWNum(gw()));
+                gw().mul(*res.Z, _d_den, *_tmp);
+                gw().sub(*_tmp, *res.ZpY, *res.ZpY, GWADD_DELAYNORM_IF(safe11)); // d_den*zz - d_num*yy
+            }
+            else
+                gw().sub(*res.Z, *res.ZpY, *res.ZpY, GWADD_DELAYNORM_IF(safe11)); // zz - d_num*yy
+            gw().mul(*res.ZmY, *res.ZpY, *res.ZmY, GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_STARTNEXTFFT_IF(safe1)); // t2
+            gw().setmulbyconst(c);
+            gw().mul(*res.Z, *res.Y, *res.Z, GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_MULBYCONST | GWMUL_STARTNEXTFFT_IF(safe1)); // t1
+        }
+        gw().copy(*res.ZmY, *res.Y);
+        gw().copy(*res.Z, *res.ZpY);
+        gw().addsub(*res.Z, *res.Y, *res.Z, *res.Y, GWADD_DELAYNORM_IF(safe1));
+    }
+
     void MontgomeryArithmetic::optimize(EdY& a)
     {
         bool safe11 = mul_safe(gw().gwdata(), 1, 1);
@@ -266,6 +328,63 @@ namespace arithmetic
     template void MontgomeryArithmetic::normalize(std::vector<EdY*>::iterator begin, std::vector<EdY*>::iterator end);
     template void MontgomeryArithmetic::normalize(std::deque<std::unique_ptr<EdY>>::iterator begin, std::deque<std::unique_ptr<EdY>>::iterator end);
 
+    void MontgomeryArithmetic::recover(EdY& a, EdY& a_plus_p, EdPoint& p, EdPoint& res)
+    {
+        // y(a + p) = (y(p)y(a) - x(p)x(a))/(1 - d*x(p)x(a)y(p)y(a)), solved for x(a)
+        // x(a) = (y(p)y(a) - y(a + p))/(x(p)(1 - d*y(p)y(a)y(a + p)))
+        GWNum A(gw()), B(gw()), C(gw());
+        std::unique_ptr<GWNum> X(new GWNum(gw()));
+        std::unique_ptr<GWNum> Y(new GWNum(gw()));
+        std::unique_ptr<GWNum> Z(new GWNum(gw()));
+        std::unique_ptr<GWNum> T(new GWNum(gw()));
+
+        gw().mul(*p.Y, *a.Y, A, 0); // yp*ya
+        if (a_plus_p.Z)
+            gw().mul(A, *a_plus_p.Z, *X, 0);
+        else
+            gw().copy(A, *X);
+        if (a.Z)
+            gw().mul(*a_plus_p.Y, *a.Z, B, 0);
+        else
+            gw().copy(*a_plus_p.Y, B);
+        if (p.Z)
+        {
+            gw().mul(B, *p.Z, B, 0);
+            gw().sub(*X, B, *X, 0);
+            gw().mul(*X, *p.Z, *X, 0); // numerator
+        }
+        else
+            gw().sub(*X, B, *X, 0);
+
+        if (a.Z && a_plus_p.Z)
+            gw().mul(*a.Z, *a_plus_p.Z, C, 0);
+        else if (a.Z || a_plus_p.Z)
+            gw().copy(a.Z ? *a.Z : *a_plus_p.Z, C);
+        else
+            gw().init(1, C);
+        if (p.Z)
+            gw().mul(C, *p.Z, C, 0);
+        gw().mul(A, *a_plus_p.Y, B, 0);
+        gw().mul(B, _ed_d, B, 0);
+        gw().sub(C, B, C, 0);
+        gw().mul(C, *p.X, C, 0); // denominator
+
+        gw().mul(*X, *a.Y, *T, 0);
+        gw().mul(C, *a.Y, *Y, 0);
+        if (a.Z)
+        {
+            gw().mul(*X, *a.Z, *X, 0);
+            gw().mul(C, *a.Z, *Z, 0);
+        }
+        else
+            gw().copy(C, *Z);
+
+        res.X = std::move(X);
+        res.Y = std::move(Y);
+        res.Z = std::move(Z);
+        res.T = std::move(T);
+    }
+
     void EdY::serialize(Giant& Y, Giant& Z)
     {
         if (this->Y)
@@ -16,6 +16,8 @@ namespace arithmetic
     public:
         MontgomeryArithmetic(GWNum& ed_d) : _gw(nullptr), _ed_d(ed_d) { }
         MontgomeryArithmetic(GWArithmetic& gw, GWNum& ed_d) : _gw(&gw), _ed_d(ed_d) { }
+        // ed_d = d_num/d_den with small integers, doublings multiply by them with gwsmallmul and GWMUL_MULBYCONST instead of ed_d. d_den = 0 keeps the full ed_d.
+        MontgomeryArithmetic(GWArithmetic& gw, GWNum& ed_d, int32_t d_num, int32_t d_den) : _gw(&gw), _ed_d(ed_d), _d_num(d_den < 0 ? -d_num : d_num), _d_den(d_den < 0 ? -d_den : d_den) { }
         virtual ~MontgomeryArithmetic() { }
 
         virtual void copy(const EdY& a, EdY& res) override;
@@ -26,6 +28,8 @@ namespace arithmetic
         virtual void add(EdY& a, EdY& b, EdY& a_minus_b, EdY& res) override;
         virtual void dbl(EdY& a, EdY& res) override;
         virtual void optimize(EdY& a) override;
+        // Recovers the full point a from a, a + p and the full point p, x(p) != 0. The ladder mul(p, b, a, a_plus_p) gives such a pair.
+        void recover(EdY& a, EdY& a_plus_p, EdPoint& p, EdPoint& res);
 
         virtual void normalize(EdY& a);
         template <typename Iter>
@@ -34,10 +38,19 @@ namespace arithmetic
         GWArithmetic& gw() { return *_gw; }
         void set_gw(GWArithmetic& gw) { _gw = &gw; }
         GWNum& ed_d() { return _ed_d; }
+        bool small_d() { return _d_den != 0; }
+        int32_t d_num() { return _d_num; }
+        int32_t d_den() { return _d_den; }
+
+    private:
+        void dbl_small_d(EdY& a, EdY& res);
 
     private:
         GWArithmetic* _gw;
         GWNum& _ed_d;
+        int32_t _d_num = 0;
+        int32_t _d_den = 0;
+        std::unique_ptr<GWNum> _tmp;
     };
 
     class EdY : public DifferentialGroupElement<MontgomeryArithmetic, EdY>
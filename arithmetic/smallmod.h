@@ -0,0 +1,460 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include "field.h"
+#include "giant.h"
+#include "integer.h"
+
+namespace arithmetic
+{
+    template<int L>
+    class SmallModNum;
+
+    // Fixed-width Montgomery arithmetic modulo an odd N < 2^(64L-1), for numbers too small to benefit from FFT multiplication.
+    template<int L>
+    class SmallModArithmetic : public FieldArithmetic<SmallModNum<L>>
+    {
+        friend class SmallModNum<L>;
+    public:
+        using Element = SmallModNum<L>;
+        static const int LIMBS = L;
+
+    public:
+        SmallModArithmetic(const Giant& N);
+        virtual ~SmallModArithmetic() { }
+
+        virtual void alloc(SmallModNum<L>& a) override { std::memset(a._data, 0, sizeof(a._data)); }
+        virtual void free(SmallModNum<L>&) override { }
+        virtual void copy(const SmallModNum<L>& a, SmallModNum<L>& res) override { std::memcpy(res._data, a._data, sizeof(a._data)); }
+        virtual void move(SmallModNum<L>&& a, SmallModNum<L>& res) override { std::memcpy(res._data, a._data, sizeof(a._data)); }
+        virtual void init(int32_t a, SmallModNum<L>& res) override;
+        virtual void init(const std::string& a, SmallModNum<L>& res) override;
+        virtual void init(const Giant& a, SmallModNum<L>& res);
+        virtual void to_giant(const SmallModNum<L>& a, Giant& res);
+        virtual int cmp(const SmallModNum<L>& a, const SmallModNum<L>& b) override;
+        virtual int cmp(const SmallModNum<L>& a, int32_t b) override;
+        virtual void add(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res) override { add(a._data, b._data, res._data); }
+        virtual void add(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res) override;
+        virtual void sub(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res) override { sub(a._data, b._data, res._data); }
+        virtual void sub(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res) override;
+        virtual void neg(SmallModNum<L>& a, SmallModNum<L>& res) override;
+        virtual void mul(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res) override { mul(a._data, b._data, res._data); }
+        virtual void mul(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res) override;
+        virtual void div(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res) override;
+        virtual void div(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res) override;
+        virtual void gcd(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res) override;
+        virtual void inv(SmallModNum<L>& a, SmallModNum<L>& n, SmallModNum<L>& res) override;
+        virtual void inv(SmallModNum<L>& a, SmallModNum<L>& res);
+        virtual void mod(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res) override;
+        virtual void pow(SmallModNum<L>& a, const Giant& exp, SmallModNum<L>& res);
+
+        Giant& N() { return _gN; }
+
+        // Raw Montgomery operations on L limbs, inputs and outputs are reduced.
+        void add(const uint64_t* a, const uint64_t* b, uint64_t* res);
+        void sub(const uint64_t* a, const uint64_t* b, uint64_t* res);
+        void mul(const uint64_t* a, const uint64_t* b, uint64_t* res);
+
+    private:
+        bool geq_N(const uint64_t* a, uint64_t carry);
+        void from_mont(const uint64_t* a, uint64_t* res);
+
+    private:
+        Giant _gN;
+        uint64_t _N[L];
+        uint64_t _ninv;
+        uint64_t _one[L];
+        uint64_t _r2[L];
+    };
+
+    template<int L>
+    class SmallModNum : public FieldElement<SmallModArithmetic<L>, SmallModNum<L>>
+    {
+        friend class SmallModArithmetic<L>;
+    public:
+        using Arithmetic = SmallModArithmetic<L>;
+
+    public:
+        SmallModNum(SmallModArithmetic<L>& arithmetic) : FieldElement<SmallModArithmetic<L>, SmallModNum<L>>(arithmetic)
+        {
+            arithmetic.alloc(*this);
+        }
+        SmallModNum(const SmallModNum<L>& a) : FieldElement<SmallModArithmetic<L>, SmallModNum<L>>(a.arithmetic())
+        {
+            this->arithmetic().copy(a, *this);
+        }
+        SmallModNum(SmallModNum<L>&& a) noexcept : FieldElement<SmallModArithmetic<L>, SmallModNum<L>>(a.arithmetic())
+        {
+            this->arithmetic().move(std::move(a), *this);
+        }
+
+        SmallModNum<L>& operator = (const SmallModNum<L>& a)
+        {
+            this->arithmetic().copy(a, *this);
+            return *this;
+        }
+        SmallModNum<L>& operator = (SmallModNum<L>&& a) noexcept
+        {
+            this->arithmetic().move(std::move(a), *this);
+            return *this;
+        }
+        using FieldElement<SmallModArithmetic<L>, SmallModNum<L>>::operator=;
+        SmallModNum<L>& operator = (const Giant& a)
+        {
+            this->arithmetic().init(a, *this);
+            return *this;
+        }
+
+        virtual std::string to_string() const override
+        {
+            Giant tmp;
+            this->arithmetic().to_giant(*this, tmp);
+            return tmp.to_string();
+        }
+        Giant to_giant() const
+        {
+            Giant res;
+            this->arithmetic().to_giant(*this, res);
+            return res;
+        }
+
+        uint64_t* data() { return _data; }
+        const uint64_t* data() const { return _data; }
+
+    private:
+        uint64_t _data[L];
+    };
+
+    // Calls f with std::integral_constant<int, L> for the smallest supported limb count fitting bitlen. Returns false if the number is too large.
+    // Above about 800 bits an exponentiation is faster with the smallest gwnum FFT, including setup.
+    const int SMALLMOD_MAX_BITS = 767;
+    template<class F>
+    bool with_small_mod(int bitlen, F&& f)
+    {
+        if (bitlen <= 63)
+            f(std::integral_constant<int, 1>());
+        else if (bitlen <= 127)
+            f(std::integral_constant<int, 2>());
+        else if (bitlen <= 191)
+            f(std::integral_constant<int, 3>());
+        else if (bitlen <= 255)
+            f(std::integral_constant<int, 4>());
+        else if (bitlen <= 383)
+            f(std::integral_constant<int, 6>());
+        else if (bitlen <= 511)
+            f(std::integral_constant<int, 8>());
+        else if (bitlen <= 639)
+            f(std::integral_constant<int, 10>());
+        else if (bitlen <= SMALLMOD_MAX_BITS)
+            f(std::integral_constant<int, 12>());
+        else
+            return false;
+        return true;
+    }
+
+    template<int L>
+    SmallModArithmetic<L>::SmallModArithmetic(const Giant& N) : _gN(N)
+    {
+        if (_gN <= 1 || !_gN.bit(0) || _gN.bitlen() > 64*L - 1)
+            throw std::invalid_argument("Modulus is out of range.");
+        std::memset(_N, 0, sizeof(_N));
+        std::memcpy(_N, _gN.data(), _gN.size()*sizeof(uint32_t));
+        _ninv = _N[0];
+        for (int i = 0; i < 5; i++)
+            _ninv *= 2 - _N[0]*_ninv;
+        _ninv = 0 - _ninv;
+
+        // R mod N, then R^2 mod N by doubling.
+        Giant tmp;
+        tmp = 1;
+        tmp <<= 64*L;
+        tmp %= _gN;
+        std::memset(_one, 0, sizeof(_one));
+        std::memcpy(_one, tmp.data(), tmp.size()*sizeof(uint32_t));
+        std::memcpy(_r2, _one, sizeof(_r2));
+        for (int i = 0; i < 64*L; i++)
+            add(_r2, _r2, _r2);
+    }
+
+    template<int L>
+    bool SmallModArithmetic<L>::geq_N(const uint64_t* a, uint64_t carry)
+    {
+        if (carry)
+            return true;
+        for (int i = L - 1; i >= 0; i--)
+            if (a[i] != _N[i])
+                return a[i] > _N[i];
+        return true;
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::add(const uint64_t* a, const uint64_t* b, uint64_t* res)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < L; i++)
+        {
+            uint64_t t = a[i] + carry;
+            carry = t < carry;
+            res[i] = t + b[i];
+            carry += res[i] < t;
+        }
+        if (geq_N(res, carry))
+        {
+            uint64_t borrow = 0;
+            for (int i = 0; i < L; i++)
+            {
+                uint64_t t = res[i] - borrow;
+                borrow = t > res[i];
+                res[i] = t - _N[i];
+                borrow += res[i] > t;
+            }
+        }
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::sub(const uint64_t* a, const uint64_t* b, uint64_t* res)
+    {
+        uint64_t borrow = 0;
+        for (int i = 0; i < L; i++)
+        {
+            uint64_t t = a[i] - borrow;
+            borrow = t > a[i];
+            res[i] = t - b[i];
+            borrow += res[i] > t;
+        }
+        if (borrow)
+        {
+            uint64_t carry = 0;
+            for (int i = 0; i < L; i++)
+            {
+                uint64_t t = res[i] + carry;
+                carry = t < carry;
+                res[i] = t + _N[i];
+                carry += res[i] < t;
+            }
+        }
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::mul(const uint64_t* a, const uint64_t* b, uint64_t* res)
+    {
+        // CIOS Montgomery multiplication.
+        uint64_t t[L + 2] = {0};
+        uint64_t hi, lo;
+        for (int i = 0; i < L; i++)
+        {
+            uint64_t carry = 0;
+            for (int j = 0; j < L; j++)
+            {
+                lo = umul128(a[j], b[i], hi);
+                lo += carry;
+                hi += lo < carry;
+                t[j] += lo;
+                carry = hi + (t[j] < lo);
+            }
+            t[L] += carry;
+            t[L + 1] = t[L] < carry;
+
+            uint64_t m = t[0]*_ninv;
+            lo = umul128(m, _N[0], hi);
+            carry = hi + (t[0] + lo < lo);
+            for (int j = 1; j < L; j++)
+            {
+                lo = umul128(m, _N[j], hi);
+                lo += carry;
+                hi += lo < carry;
+                t[j - 1] = t[j] + lo;
+                carry = hi + (t[j - 1] < lo);
+            }
+            t[L - 1] = t[L] + carry;
+            t[L] = t[L + 1] + (t[L - 1] < carry);
+        }
+        if (geq_N(t, t[L]))
+        {
+            uint64_t borrow = 0;
+            for (int i = 0; i < L; i++)
+            {
+                uint64_t s = t[i] - borrow;
+                borrow = s > t[i];
+                res[i] = s - _N[i];
+                borrow += res[i] > s;
+            }
+        }
+        else
+            std::memcpy(res, t, L*sizeof(uint64_t));
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::from_mont(const uint64_t* a, uint64_t* res)
+    {
+        uint64_t unit[L] = {1};
+        mul(a, unit, res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::init(const Giant& a, SmallModNum<L>& res)
+    {
+        Giant tmp;
+        tmp = a;
+        if (tmp.bitlen() > 64*L - 1 || tmp < 0)
+        {
+            tmp %= _gN;
+            if (tmp < 0)
+                tmp += _gN;
+        }
+        uint64_t value[L] = {0};
+        std::memcpy(value, tmp.data(), tmp.size()*sizeof(uint32_t));
+        mul(value, _r2, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::init(int32_t a, SmallModNum<L>& res)
+    {
+        uint64_t value[L] = {(uint64_t)(a < 0 ? -(int64_t)a : a)};
+        mul(value, _r2, res._data);
+        if (a < 0)
+            neg(res, res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::init(const std::string& a, SmallModNum<L>& res)
+    {
+        Giant tmp;
+        tmp = a;
+        init(tmp, res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::to_giant(const SmallModNum<L>& a, Giant& res)
+    {
+        uint64_t value[L];
+        from_mont(a._data, value);
+        res.arithmetic().init((uint32_t*)value, 2*L, res);
+    }
+
+    template<int L>
+    int SmallModArithmetic<L>::cmp(const SmallModNum<L>& a, const SmallModNum<L>& b)
+    {
+        if (&a == &b)
+            return 0;
+        uint64_t va[L], vb[L];
+        from_mont(a._data, va);
+        from_mont(b._data, vb);
+        for (int i = L - 1; i >= 0; i--)
+            if (va[i] != vb[i])
+                return va[i] > vb[i] ? 1 : -1;
+        return 0;
+    }
+
+    template<int L>
+    int SmallModArithmetic<L>::cmp(const SmallModNum<L>& a, int32_t b)
+    {
+        SmallModNum<L> tmp(*this);
+        init(b, tmp);
+        return cmp(a, tmp);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::add(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res)
+    {
+        SmallModNum<L> tmp(*this);
+        init(b, tmp);
+        add(a._data, tmp._data, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::sub(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res)
+    {
+        SmallModNum<L> tmp(*this);
+        init(b, tmp);
+        sub(a._data, tmp._data, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::neg(SmallModNum<L>& a, SmallModNum<L>& res)
+    {
+        uint64_t zero[L] = {0};
+        sub(zero, a._data, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::mul(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res)
+    {
+        SmallModNum<L> tmp(*this);
+        init(b, tmp);
+        mul(a._data, tmp._data, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::div(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res)
+    {
+        SmallModNum<L> inv_b(*this);
+        inv(b, inv_b);
+        mul(a._data, inv_b._data, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::div(SmallModNum<L>& a, int32_t b, SmallModNum<L>& res)
+    {
+        SmallModNum<L> inv_b(*this);
+        init(b, inv_b);
+        inv(inv_b, inv_b);
+        mul(a._data, inv_b._data, res._data);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::gcd(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res)
+    {
+        Giant tmp = b.to_giant();
+        Giant tmp2 = a.to_giant();
+        init(tmp2.gcd(tmp), res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::inv(SmallModNum<L>& a, SmallModNum<L>& n, SmallModNum<L>& res)
+    {
+        Giant tmp = n.to_giant();
+        Giant tmp2 = a.to_giant();
+        init(tmp2.inv(tmp), res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::inv(SmallModNum<L>& a, SmallModNum<L>& res)
+    {
+        Giant tmp = a.to_giant();
+        init(tmp.inv(_gN), res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::mod(SmallModNum<L>& a, SmallModNum<L>& b, SmallModNum<L>& res)
+    {
+        Giant tmp = b.to_giant();
+        init(a.to_giant()%tmp, res);
+    }
+
+    template<int L>
+    void SmallModArithmetic<L>::pow(SmallModNum<L>& a, const Giant& exp, SmallModNum<L>& res)
+    {
+        // Fixed 4-bit window.
+        uint64_t table[16][L];
+        std::memcpy(table[0], _one, sizeof(_one));
+        std::memcpy(table[1], a._data, sizeof(a._data));
+        for (int i = 2; i < 16; i++)
+            mul(table[i - 1], a._data, table[i]);
+        uint64_t acc[L];
+        std::memcpy(acc, _one, sizeof(_one));
+        int len = exp.bitlen();
+        for (int i = (len + 3)/4*4 - 4; i >= 0; i -= 4)
+        {
+            if (i + 4 < len)
+                for (int j = 0; j < 4; j++)
+                    mul(acc, acc, acc);
+            int w = (exp.bit(i + 3) ? 8 : 0) + (exp.bit(i + 2) ? 4 : 0) + (exp.bit(i + 1) ? 2 : 0) + (exp.bit(i) ? 1 : 0);
+            if (w != 0)
+                mul(acc, table[w], acc);
+        }
+        std::memcpy(res._data, acc, sizeof(acc));
+    }
+}
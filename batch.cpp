@@ -0,0 +1,119 @@
+
+#include <algorithm>
+#include <memory>
+#include "gwnum.h"
+#include "cpuid.h"
+#include "batch.h"
+#include "smallmod.h"
+
+using namespace arithmetic;
+
+bool BatchFermat::supported(InputNum& input)
+{
+    return input.bitlen() <= SMALLMOD_MAX_BITS + 1 && input.value().bitlen() <= SMALLMOD_MAX_BITS && input.value() > 3 && input.value().bit(0);
+}
+
+template<int L>
+void BatchFermat::run_lanes(std::vector<InputNum>& inputs, const size_t* indices, int count, int a)
+{
+    std::vector<std::unique_ptr<SmallModArithmetic<L>>> arithmetics;
+    std::vector<Giant> exps;
+    std::vector<SmallModNum<L>> X;
+    int len = 0;
+    for (int l = 0; l < count; l++)
+    {
+        Giant N = inputs[indices[l]].value();
+        arithmetics.emplace_back(new SmallModArithmetic<L>(N));
+        exps.push_back(N - 1);
+        X.emplace_back(*arithmetics.back());
+        X.back() = 1;
+        len = std::max(len, exps.back().bitlen());
+    }
+
+    // X = a^(N-1), multiplication by a is done with additions.
+    int a_len;
+    for (a_len = 31; a_len > 0 && !((a >> a_len) & 1); a_len--);
+    uint64_t T[L];
+    for (int i = len - 1; i >= 0; i--)
+    {
+        for (int l = 0; l < count; l++)
+            arithmetics[l]->mul(X[l].data(), X[l].data(), X[l].data());
+        for (int l = 0; l < count; l++)
+            if (exps[l].bit(i))
+            {
+                uint64_t* x = X[l].data();
+                std::copy(x, x + L, T);
+                for (int j = a_len - 1; j >= 0; j--)
+                {
+                    arithmetics[l]->add(x, x, x);
+                    if ((a >> j) & 1)
+                        arithmetics[l]->add(x, T, x);
+                }
+            }
+    }
+
+    for (int l = 0; l < count; l++)
+    {
+        _prime[indices[l]] = X[l] == 1;
+        _res64[indices[l]] = X[l].to_giant().to_res64();
+    }
+}
+
+void BatchFermat::run(std::vector<InputNum>& inputs, Logging& logging)
+{
+    _prime.assign(inputs.size(), false);
+    _res64.assign(inputs.size(), std::string());
+
+    std::vector<size_t> indices;
+    std::vector<int> bitlens(inputs.size());
+    std::vector<int> bases(inputs.size());
+    std::string reason;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (InputNum::PRESCREEN && !inputs[i].prescreen(reason))
+        {
+            logging.result(false, "%s is not prime, %s.\n", inputs[i].display_text().data(), reason.data());
+            logging.result_save(inputs[i].input_text() + " is not prime, " + reason + ".\n");
+            continue;
+        }
+        if (!supported(inputs[i]))
+            throw std::invalid_argument(inputs[i].display_text() + " is not supported by batch testing.");
+        bitlens[i] = inputs[i].value().bitlen();
+        // a^(N-1) is 0 if N divides a, such numbers are odd and at least 5, so 2 is a proper base.
+        bases[i] = bitlens[i] < 32 && _a%(int)inputs[i].value().data()[0] == 0 ? 2 : _a;
+        indices.push_back(i);
+    }
+    std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) { return bitlens[a] < bitlens[b] || (bitlens[a] == bitlens[b] && bases[a] < bases[b]); });
+
+    double timer = getHighResTimer();
+    for (size_t i = 0; i < indices.size(); )
+    {
+        // Lanes share the limb count and the base.
+        size_t count = 1;
+        with_small_mod(bitlens[indices[i]], [&](auto limbs)
+        {
+            for (; count < LANES && i + count < indices.size(); count++)
+            {
+                bool same = false;
+                with_small_mod(bitlens[indices[i + count]], [&](auto other) { same = decltype(other)::value == decltype(limbs)::value; });
+                if (!same || bases[indices[i + count]] != bases[indices[i]])
+                    break;
+            }
+            run_lanes<decltype(limbs)::value>(inputs, indices.data() + i, (int)count, bases[indices[i]]);
+        });
+
+        for (size_t j = i; j < i + count; j++)
+        {
+            InputNum& input = inputs[indices[j]];
+            if (_prime[indices[j]])
+                logging.result(true, "%s is a probable prime.\n", input.display_text().data());
+            else
+                logging.result(false, "%s is not prime. RES64: %s.\n", input.display_text().data(), _res64[indices[j]].data());
+            logging.result_save(input.input_text() + (_prime[indices[j]] ? " is a probable prime" : " is not prime. RES64: " + _res64[indices[j]]) + ".\n");
+        }
+        i += count;
+        logging.progress().update(i/(double)indices.size(), 0);
+        logging.heartbeat();
+    }
+    logging.info("%d numbers tested in %.3f s.\n", (int)indices.size(), (getHighResTimer() - timer)/getHighResTimerFrequency());
+}
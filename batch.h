@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "inputnum.h"
+#include "logging.h"
+
+// Fermat PRP test of many small numbers at once. Numbers of the same size run their exponentiations in lock-step lanes of fixed-width Montgomery arithmetic.
+class BatchFermat
+{
+public:
+    static const int LANES = 8;
+
+public:
+    BatchFermat(int a = 3) : _a(a) { }
+
+    static bool supported(InputNum& input);
+    void run(std::vector<InputNum>& inputs, Logging& logging);
+
+    bool prime(size_t index) { return _prime[index]; }
+    const std::string& res64(size_t index) { return _res64[index]; }
+
+private:
+    template<int L>
+    void run_lanes(std::vector<InputNum>& inputs, const size_t* indices, int count, int a);
+
+private:
+    int _a;
+    std::vector<bool> _prime;
+    std::vector<std::string> _res64;
+};
@@ -7,6 +7,8 @@
 #include <cctype>
 #include <cerrno>
 #include <cmath>
+#include <thread>
+#include <atomic>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +20,8 @@
 #else
 #include <unistd.h>
 #endif
+#include <sys/types.h>
+#include <sys/stat.h>
 
 namespace container
 {
@@ -662,6 +666,7 @@ namespace container
                 _length = ftello((FILE*)_stream) - start;
                 fseeko((FILE*)_stream, start, SEEK_SET);
 #endif
+                _offset = start;
             }
             else
                 throw std::runtime_error("File random access failed.");
@@ -772,6 +777,32 @@ namespace container
         return false;
     }
 
+    int64_t FileStream::file_length()
+    {
+        if (!_stream)
+            return -1;
+#ifdef _WIN32
+        struct _stat64 st;
+        if (_fstat64(_fileno((FILE*)_stream), &st) != 0)
+#else
+        struct stat st;
+        if (fstat(fileno((FILE*)_stream), &st) != 0)
+#endif
+            return -1;
+        return (int64_t)st.st_size;
+    }
+
+    int FileStream::descriptor()
+    {
+        if (!_stream)
+            return -1;
+#ifdef _WIN32
+        return _fileno((FILE*)_stream);
+#else
+        return fileno((FILE*)_stream);
+#endif
+    }
+
     void FileStream::write(const char* buffer, size_t count)
     {
         if (!_stream)
@@ -808,6 +839,72 @@ namespace container
             throw std::runtime_error("File close failed.");
     }
 
+    PositionalReadStream::PositionalReadStream(FileStream& stream) : _descriptor(stream.descriptor()), _offset(stream.offset()), _length(stream.length())
+    {
+#ifdef _WIN32
+        // ReadFile at an offset moves the file pointer of its handle, the FILE stream keeps its own.
+        if (_descriptor >= 0)
+        {
+            HANDLE handle = ReOpenFile((HANDLE)_get_osfhandle(_descriptor), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0);
+            if (handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("File open failed.");
+            _handle = handle;
+        }
+#endif
+    }
+
+    PositionalReadStream::~PositionalReadStream()
+    {
+#ifdef _WIN32
+        if (_handle != nullptr)
+            CloseHandle((HANDLE)_handle);
+#endif
+    }
+
+    void PositionalReadStream::set_position(int64_t value)
+    {
+        if (value < 0 || value > _length)
+            throw std::out_of_range("Invalid file position.");
+        _pos = value;
+    }
+
+    size_t PositionalReadStream::read(char* buffer, size_t count)
+    {
+        if (_descriptor < 0)
+            return 0;
+        if (_pos >= _length)
+            return 0;
+        if (_pos + (int64_t)count > _length)
+            count = (size_t)(_length - _pos);
+        size_t total = 0;
+        while (total < count)
+        {
+#ifdef _WIN32
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = (DWORD)(_offset + _pos);
+            overlapped.OffsetHigh = (DWORD)((_offset + _pos) >> 32);
+            DWORD res;
+            if (!ReadFile((HANDLE)_handle, buffer + total, (DWORD)(count - total), &res, &overlapped))
+            {
+                if (GetLastError() != ERROR_HANDLE_EOF)
+                    throw std::runtime_error("File read failed.");
+                res = 0;
+            }
+#else
+            ssize_t res = pread(_descriptor, buffer + total, count - total, (off_t)(_offset + _pos));
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0)
+                throw std::runtime_error("File read failed.");
+#endif
+            if (res == 0)
+                break;
+            total += res;
+            _pos += res;
+        }
+        return total;
+    }
+
     int ChunkedWriteStream::MAX_BUFFER_SIZE = 16777200;
 
     void ChunkedWriteStream::set_length(int64_t value)
@@ -1006,18 +1103,15 @@ namespace container
                 throw container_error("Base64 invalid character.");
             if (_state == 0)
             {
-                if (buffer)
-                    _next = c << 2;
+                _next = c << 2;
                 _state++;
             }
             else if (_state == 1)
             {
                 if (buffer)
-                {
-                    *buffer = _next + (c >> 4);
-                    buffer++, total++, count--;
-                    _next = (c & 15) << 4;
-                }
+                    *buffer++ = _next + (c >> 4);
+                total++, count--;
+                _next = (c & 15) << 4;
                 _state++;
             }
             else if (_state == 2 && c == 64)
@@ -1025,11 +1119,9 @@ namespace container
             else if (_state == 2)
             {
                 if (buffer)
-                {
-                    *buffer = _next + (c >> 2);
-                    buffer++, total++, count--;
-                    _next = (c & 3) << 6;
-                }
+                    *buffer++ = _next + (c >> 2);
+                total++, count--;
+                _next = (c & 3) << 6;
                 _state++;
             }
             else if (_state == 3 && c == 64)
@@ -1037,10 +1129,8 @@ namespace container
             else if (_state == 3)
             {
                 if (buffer)
-                {
-                    *buffer = _next + c;
-                    buffer++, total++, count--;
-                }
+                    *buffer++ = _next + c;
+                total++, count--;
                 _state = 0;
             }
             else if (_state == 4 && c == 64)
@@ -1096,6 +1186,10 @@ namespace container
             }
         }
 
+        for (auto& file : _index)
+            if (file.size > 0 && file.stream > 0 && !file.md5.empty())
+                _dedup[std::make_pair(file.size, file.md5)] = (FileDesc*)&file;
+
         try
         {
             container._stream->set_position(pos);
@@ -1110,6 +1204,8 @@ namespace container
             on_error(e);
         }
 
+        if (container._cur_file != nullptr)
+            container._cur_file->data.reset();
         container._cur_file = nullptr;
         container._cur_reader.reset();
     }
@@ -1151,6 +1247,7 @@ namespace container
             _container->_index = std::move(_index);
             _container->_next_stream_id = _next_id;
         }
+        _dedup.clear();
     }
 
     class Packer::Writer::Index : public WriteStream
@@ -1336,6 +1433,8 @@ namespace container
                     throw container_error("MD5 hash mismatch.");
                 index->file().md5 = md5hash;
                 index->set_value("md5", index->file().md5);
+                if (index->file().size > 0 && index->file().stream > 0)
+                    _writer._packer._dedup[std::make_pair(index->file().size, index->file().md5)] = &index->file();
             }
 
             _stream = nullptr;
@@ -1381,17 +1480,41 @@ namespace container
     {
         if (!_packer._stream)
             throw std::runtime_error("Invalid packer.");
+        if (_packer.dedup && count > 0)
+        {
+            char md5hash[33];
+            md5_raw_input(md5hash, (unsigned char *)buffer, (unsigned int)count);
+            auto it = _packer._dedup.find(std::make_pair((int64_t)count, std::string(md5hash)));
+            if (it != _packer._dedup.end())
+            {
+                FileDesc& file = *it->second;
+                if (file.size == (int64_t)count && file.stream > 0 && file.md5 == md5hash)
+                {
+                    if (file.name != filename)
+                        add_reference(filename, file);
+                    return;
+                }
+                _packer._dedup.erase(it);
+            }
+        }
         WriteStream* stream = add_file(filename, count);
         if (stream == nullptr)
             return;
+        // The stream closes itself once the declared size is written.
         stream->write(buffer, count);
-        stream->close();
     }
 
     WriteStream* Packer::Writer::add_file(const std::string& filename, int64_t size)
     {
         if (!_packer._stream)
             throw std::runtime_error("Invalid packer.");
+        FileDesc& file = reset_file(filename);
+        file.size = size;
+        return add_file(&file);
+    }
+
+    FileDesc& Packer::Writer::reset_file(const std::string& filename)
+    {
         FileDesc& file = _packer.index()[filename];
         if (_packer._container && file.stream > 0)
         {
@@ -1408,8 +1531,35 @@ namespace container
                     it++;
         }
         file.reset();
-        file.size = size;
-        return add_file(&file);
+        return file;
+    }
+
+    void Packer::Writer::add_reference(const std::string& filename, const FileDesc& source)
+    {
+        if (_streams.empty())
+            throw std::runtime_error("Writer closed.");
+        if (dynamic_cast<Packer::Writer::Stream*>(_streams.back().get()) != nullptr)
+            throw std::runtime_error("Another write operation in progress.");
+
+        FileDesc& file = reset_file(filename);
+        file.size = source.size;
+        file.stream = source.stream;
+        file.offset = source.offset;
+        file.md5 = source.md5;
+
+        Packer::Writer::Index* index = dynamic_cast<Packer::Writer::Index*>(_streams.front().get());
+        index->node(&file);
+        index->set_value("size", file.size);
+        index->set_value("stream", file.stream);
+        if (file.offset > 0)
+            index->set_value("offset", file.offset);
+        index->set_value("md5", file.md5);
+
+        if (_packer._container)
+        {
+            auto& files = _packer._container->_streams[file.stream].files;
+            files.insert(std::upper_bound(files.begin(), files.end(), file.offset, [](const int64_t& a, FileDesc* b) { return a < b->offset; }), &file);
+        }
     }
 
     WriteStream* Packer::Writer::add_file(FileDesc* file)
@@ -1455,11 +1605,528 @@ namespace container
             }
     }
 
+    struct Unpacker::Job
+    {
+        int64_t stream_id;
+        bool base64;
+        bool decoded = false;
+        std::vector<char> data;
+    };
+
+    struct Unpacker::Output
+    {
+        FileDesc* file;
+        WriteStream* stream;
+        int64_t pos = 0;
+        std::vector<char> pending;
+        bool done = false;
+        std::string digest;
+        MD5_CTX md5_context;
+        std::vector<char> data;
+        // Files referring to this one, restored when it is complete.
+        std::vector<std::string> references;
+    };
+
+    Unpacker::Unpacker(std::function<WriteStream*(FileDesc&)> on_file, int thread_count) : _on_file(on_file), _thread_count(thread_count)
+    {
+        if (_thread_count <= 0)
+            _thread_count = std::thread::hardware_concurrency();
+        if (_thread_count <= 0)
+            _thread_count = 1;
+    }
+
+    Unpacker::~Unpacker()
+    {
+        if (_threads.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_error)
+                _error = std::make_exception_ptr(std::runtime_error("Unpacker destroyed."));
+        }
+        _cond.notify_all();
+        stop();
+    }
+
+    void Unpacker::start()
+    {
+        if (!_threads.empty())
+            return;
+        _threads.emplace_back(&Unpacker::deliver_thread, this);
+        for (int i = 0; i < _thread_count; i++)
+            _threads.emplace_back(&Unpacker::decode_thread, this);
+    }
+
+    void Unpacker::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished = true;
+        }
+        _cond.notify_all();
+        for (auto& thread : _threads)
+            thread.join();
+        _threads.clear();
+    }
+
+    void Unpacker::check_error()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_error)
+            std::rethrow_exception(_error);
+    }
+
+    void Unpacker::write(const char* buffer, size_t count)
+    {
+        check_error();
+        start();
+        while (count > 0)
+        {
+            if (_state == 2)
+            {
+                size_t len = count < _left ? count : _left;
+                _job->data.insert(_job->data.end(), buffer, buffer + len);
+                buffer += len, count -= len;
+                _left -= len;
+                if (_left == 0)
+                {
+                    enqueue();
+                    _state = 1;
+                }
+                continue;
+            }
+            if (_state == 3)
+                throw container_error("Excess data.");
+            const char* eol = (const char*)memchr(buffer, '\n', count);
+            size_t len = eol != nullptr ? eol - buffer + 1 : count;
+            _line.append(buffer, len);
+            buffer += len, count -= len;
+            if (_line.size() > 1024)
+                throw container_error("Invalid chunk header.");
+            if (eol != nullptr)
+            {
+                parse_header();
+                _line.clear();
+            }
+        }
+    }
+
+    void Unpacker::parse_header()
+    {
+        JSON json;
+        if (_state == 0)
+        {
+            if (!json.parse(_line) ||
+                !json.root().is_array() || json.root().size() < 3 ||
+                !json.root()[0].is_string() || (json.root()[0].value_string() != "PK" && json.root()[0].value_string() != "7f" && json.root()[0].value_string() != "\xD0\x9A") ||
+                !json.root()[1].is_int() || json.root()[1].value_int() != 1)
+                throw container_error("Invalid container header.");
+            _state = 1;
+            return;
+        }
+
+        if (!json.parse(_line) ||
+            !json.root().is_array() || json.root().size() < 2 ||
+            !json.root()[0].is_int() ||
+            !json.root()[1].is_int())
+            throw container_error("Invalid chunk header.");
+        int64_t chunk_size = json.root()[0].value_int();
+        int64_t stream_id = json.root()[1].value_int();
+        if (chunk_size < 0 || stream_id < 0)
+            throw container_error("Invalid chunk header.");
+        if (chunk_size == 0)
+        {
+            if (stream_id == 0)
+                _state = 3;
+            return;
+        }
+
+        _job.reset(new Job());
+        _job->stream_id = stream_id;
+        _job->base64 = false;
+        if (stream_id > 0)
+        {
+            Segment& segment = _segments[stream_id];
+            if (json.root().size() >= 3)
+            {
+                if (!segment.carry.empty())
+                    throw container_error("Codec error.");
+                JSON::Node& codec = json.root()[2];
+                if (codec.is_array() && codec.size() == 1)
+                    segment.base64 = codec[0].is_string() && codec[0].value_string() == "base64";
+                else
+                    segment.base64 = codec.is_string() && codec.value_string() == "base64";
+                if (!segment.base64 && !codec.is_null())
+                    throw container_error("Unsupported codec.");
+            }
+            _job->base64 = segment.base64;
+            _job->data = std::move(segment.carry);
+            segment.carry.clear();
+        }
+        _job->data.reserve(_job->data.size() + (size_t)chunk_size);
+        _left = (size_t)chunk_size;
+        _state = 2;
+    }
+
+    void Unpacker::enqueue()
+    {
+        if (_job->base64)
+        {
+            // A base64 quantum can span chunks, the incomplete tail goes to the next chunk of the stream.
+            size_t chars = 0;
+            for (char c : _job->data)
+                if (!std::isspace(c))
+                    chars++;
+            size_t tail = _job->data.size();
+            for (chars &= 3; chars > 0; )
+                if (!std::isspace(_job->data[--tail]))
+                    chars--;
+            Segment& segment = _segments[_job->stream_id];
+            segment.carry.assign(_job->data.begin() + tail, _job->data.end());
+            _job->data.resize(tail);
+        }
+        else
+            _job->decoded = true;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [&] { return _jobs.size() < (size_t)(2*_thread_count + 2) || _error; });
+            if (_error)
+                std::rethrow_exception(_error);
+            _jobs.push_back(_job);
+            _in_flight++;
+            if (!_job->decoded)
+                _decode_queue.push_back(_job);
+        }
+        _cond.notify_all();
+        _job.reset();
+    }
+
+    void Unpacker::decode_thread()
+    {
+        while (true)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.wait(lock, [&] { return !_decode_queue.empty() || _finished || _error; });
+                if (_decode_queue.empty() || _error)
+                    return;
+                job = std::move(_decode_queue.front());
+                _decode_queue.pop_front();
+            }
+            try
+            {
+                MemoryStream raw(std::move(job->data));
+                Base64DecoderReadStream decoder(raw);
+                std::vector<char> data((size_t)raw.length()/4*3 + 3);
+                data.resize(decoder.read(data.data(), data.size()));
+                job->data = std::move(data);
+            }
+            catch (const std::exception&)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_error)
+                    _error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                job->decoded = true;
+            }
+            _cond.notify_all();
+        }
+    }
+
+    void Unpacker::deliver_thread()
+    {
+        while (true)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.wait(lock, [&] { return (!_jobs.empty() && _jobs.front()->decoded) || (_finished && _jobs.empty()) || _error; });
+                if (_error || _jobs.empty())
+                    return;
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+            _cond.notify_all();
+            // Counts the job as delivered on every exit path, flush() waits for the count.
+            struct InFlight
+            {
+                Unpacker& unpacker;
+                ~InFlight()
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(unpacker._mutex);
+                        unpacker._in_flight--;
+                    }
+                    unpacker._cond.notify_all();
+                }
+            } in_flight{*this};
+            try
+            {
+                if (job->stream_id == 0)
+                    deliver_index(job->data);
+                else
+                    deliver_data(job->stream_id, job->data);
+            }
+            catch (...)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_error)
+                        _error = std::current_exception();
+                }
+                _cond.notify_all();
+                return;
+            }
+        }
+    }
+
+    void Unpacker::remove_output(const std::string& filename)
+    {
+        auto it = _outputs.find(filename);
+        if (it == _outputs.end())
+            return;
+        auto& files = _delivery[it->second->file->stream].files;
+        auto it_file = std::find(files.begin(), files.end(), it->second.get());
+        if (it_file != files.end())
+            files.erase(it_file);
+        if (!it->second->done)
+            it->second->stream->close();
+        _outputs.erase(it);
+    }
+
+    void Unpacker::write_output(Output& output, const char* buffer, size_t count)
+    {
+        if (count > 0)
+        {
+            output.stream->write(buffer, count);
+            MD5Update(&output.md5_context, (unsigned char *)buffer, (unsigned int)count);
+            if (dedup)
+                output.data.insert(output.data.end(), buffer, buffer + count);
+            output.pos += count;
+        }
+        if (output.pos < output.file->size)
+            return;
+
+        output.stream->close();
+        std::vector<unsigned char> digest(16);
+        MD5Final(digest.data(), &output.md5_context);
+        char md5hash[33];
+        for (int i = 0; i < 16; i++)
+            snprintf(md5hash + i*2, 3, "%02x", digest[i]);
+        output.digest = md5hash;
+        output.done = true;
+        auto& files = _delivery[output.file->stream].files;
+        files.erase(std::find(files.begin(), files.end(), &output));
+        if (!dedup)
+            return;
+
+        std::vector<char>& data = _retained[std::make_pair(output.file->stream, output.file->offset)];
+        data = std::move(output.data);
+        output.data.clear();
+        for (auto& filename : output.references)
+            if (_index.contains(filename))
+            {
+                FileDesc& file = _index[filename];
+                if (file.stream == output.file->stream && file.offset == output.file->offset)
+                    restore_reference(file, data);
+            }
+        output.references.clear();
+    }
+
+    void Unpacker::restore_reference(FileDesc& file, const std::vector<char>& data)
+    {
+        if (file.size != (int64_t)data.size())
+        {
+            _skipped.push_back(file.name);
+            return;
+        }
+        if (!file.md5.empty())
+        {
+            char md5hash[33];
+            md5_raw_input(md5hash, (unsigned char *)data.data(), (unsigned int)data.size());
+            if (file.md5 != md5hash)
+                throw container_error("MD5 hash mismatch.");
+        }
+        WriteStream* stream = _on_file(file);
+        if (stream == nullptr)
+            return;
+        stream->write(data.data(), data.size());
+        stream->close();
+    }
+
+    void Unpacker::check_output(Output& output)
+    {
+        // Packer writes the size and MD5 of a file after its data, so both can arrive in a later index block.
+        if (output.file->size >= 0 && !output.pending.empty())
+        {
+            std::vector<char> pending(std::move(output.pending));
+            output.pending.clear();
+            size_t count = (size_t)(output.file->size - output.pos);
+            write_output(output, pending.data(), pending.size() < count ? pending.size() : count);
+        }
+        if (output.file->size == 0 && !output.done)
+            write_output(output, nullptr, 0);
+        if (output.done && !output.file->md5.empty())
+        {
+            if (output.digest != output.file->md5)
+                throw container_error("MD5 hash mismatch.");
+            _outputs.erase(output.file->name);
+        }
+    }
+
+    void Unpacker::deliver_index(std::vector<char>& data)
+    {
+        JSON json;
+        if (!json.parse(std::string(data.begin(), data.end())))
+            throw container_error("Index corrupted.");
+        if (!json.root().is_array())
+            return;
+        for (auto& node : json.root().values())
+        {
+            if (!node.is_object() || !node.contains("file") || !node["file"].is_string())
+                continue;
+            std::string filename = node["file"].value_string();
+            FileDesc& file = _index[filename];
+            auto it = _outputs.find(filename);
+            bool located = node.contains("stream") && node["stream"].is_int();
+            if (located)
+            {
+                int64_t stream_id = node["stream"].value_int();
+                int64_t offset = node.contains("offset") && node["offset"].is_int() ? node["offset"].value_int() : 0;
+                if (it != _outputs.end() && (file.stream != stream_id || file.offset != offset))
+                {
+                    remove_output(filename);
+                    it = _outputs.end();
+                }
+                if (it == _outputs.end())
+                {
+                    file.reset();
+                    file.stream = stream_id;
+                }
+            }
+            if (node.contains("size") && node["size"].is_int())
+                file.size = node["size"].value_int();
+            if (node.contains("offset") && node["offset"].is_int())
+                file.offset = node["offset"].value_int();
+            if (node.contains("md5") && node["md5"].is_string())
+                file.md5 = node["md5"].value_string();
+
+            if (it != _outputs.end())
+            {
+                check_output(*it->second);
+                continue;
+            }
+            if (!located && file.size == 0 && node.contains("size"))
+            {
+                WriteStream* stream = _on_file(file);
+                if (stream != nullptr)
+                    stream->close();
+                continue;
+            }
+            if (!located || file.stream <= 0)
+                continue;
+            Delivery& delivery = _delivery[file.stream];
+            if (file.size != 0 && file.offset < delivery.pos)
+            {
+                if (dedup)
+                {
+                    auto it_data = _retained.find(std::make_pair(file.stream, file.offset));
+                    if (it_data != _retained.end())
+                    {
+                        restore_reference(file, it_data->second);
+                        continue;
+                    }
+                    auto it_source = std::find_if(delivery.files.begin(), delivery.files.end(), [&](Output* output) { return output->file->offset == file.offset; });
+                    if (it_source != delivery.files.end())
+                    {
+                        (*it_source)->references.push_back(filename);
+                        continue;
+                    }
+                }
+                _skipped.push_back(filename);
+                continue;
+            }
+            WriteStream* stream = _on_file(file);
+            if (stream == nullptr)
+                continue;
+            Output& output = *(_outputs[filename] = std::unique_ptr<Output>(new Output()));
+            output.file = &file;
+            output.stream = stream;
+            MD5Init(&output.md5_context);
+            delivery.files.insert(std::upper_bound(delivery.files.begin(), delivery.files.end(), file.offset, [](const int64_t& a, Output* b) { return a < b->file->offset; }), &output);
+            check_output(output);
+        }
+    }
+
+    void Unpacker::deliver_data(int64_t stream_id, std::vector<char>& data)
+    {
+        Delivery& delivery = _delivery[stream_id];
+        int64_t begin = delivery.pos;
+        int64_t end = begin + (int64_t)data.size();
+        delivery.pos = end;
+        std::vector<Output*> files;
+        for (auto output : delivery.files)
+            if (output->file->offset < end)
+                files.push_back(output);
+        for (auto output : files)
+        {
+            FileDesc* file = output->file;
+            int64_t from = file->offset + output->pos + (int64_t)output->pending.size();
+            if (from < begin)
+                from = begin;
+            if (file->size < 0)
+            {
+                output->pending.insert(output->pending.end(), data.begin() + (from - begin), data.end());
+                continue;
+            }
+            int64_t to = file->offset + file->size < end ? file->offset + file->size : end;
+            if (from < to)
+                write_output(*output, data.data() + (from - begin), (size_t)(to - from));
+            check_output(*output);
+        }
+    }
+
+    void Unpacker::flush()
+    {
+        check_error();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] { return _in_flight == 0 || _error; });
+        if (_error)
+            std::rethrow_exception(_error);
+    }
+
+    void Unpacker::close()
+    {
+        check_error();
+        if (_threads.empty() && _state == 0)
+            return;
+        stop();
+        check_error();
+        if (_state != 3)
+            throw container_error("Unexpected end of stream.");
+        for (auto& [id, segment] : _segments)
+            if (!segment.carry.empty())
+                throw container_error("Codec error.");
+        for (auto& [filename, output] : _outputs)
+            if (!output->done)
+            {
+                _skipped.push_back(filename);
+                output->stream->close();
+            }
+        _outputs.clear();
+        _delivery.clear();
+        _retained.clear();
+    }
+
 
     class FileContainer::Reader::RawReadStream : public ReadStream
     {
     public:
-        RawReadStream(FileStream& stream, const std::vector<Chunk>::iterator& chunk, const std::vector<Chunk>::iterator& end) : _stream(stream), _chunk(chunk), _end(end)
+        RawReadStream(ReadStream& stream, const std::vector<Chunk>::iterator& chunk, const std::vector<Chunk>::iterator& end) : _stream(stream), _chunk(chunk), _end(end)
         {
             for (auto it = _chunk; it != end; it++)
                 _length += it->size;
@@ -1517,7 +2184,7 @@ namespace container
         }
 
     private:
-        FileStream& _stream;
+        ReadStream& _stream;
         std::vector<Chunk>::iterator _chunk;
         std::vector<Chunk>::iterator _end;
         int64_t _length = 0;
@@ -1572,13 +2239,12 @@ namespace container
     {
         while (!_streams.empty())
             _streams.pop_back();
-        std::vector<Chunk>& chunks = _container._streams[_stream_id].chunks;
-        if (begin == chunks.end())
+        if (begin == _chunks.end())
             return;
         auto end = begin;
-        for (end++; end != chunks.end() && (!end->codec || end->codec->root().is_null()); end++)
+        for (end++; end != _chunks.end() && (!end->codec || end->codec->root().is_null()); end++)
             ;
-        _streams.emplace_back(new RawReadStream(*_container._stream, begin, end));
+        _streams.emplace_back(new RawReadStream(_file, begin, end));
         if (begin->codec && (begin->codec->root().is_string() || begin->codec->root().is_object()))
             add_codec(begin->codec->root());
         if (begin->codec && begin->codec->root().is_array())
@@ -1774,8 +2440,9 @@ namespace container
         {
             std::sort(stream.files.begin(), stream.files.end(), [](FileDesc*& a, FileDesc*& b) { return a->offset < b->offset; });
             int64_t offset = 0;
+            FileDesc* prev = nullptr;
             for (auto it = stream.files.begin(); it != stream.files.end(); )
-                if ((*it)->stream != id || (*it)->size < 0 || ((*it)->size > 0 && (*it)->offset < offset))
+                if ((*it)->stream != id || (*it)->size < 0 || ((*it)->size > 0 && (*it)->offset < offset && (prev == nullptr || (*it)->offset != prev->offset || (*it)->size != prev->size)))
                 {
                     on_corrupted(*it, 0);
                     it = stream.files.erase(it);
@@ -1786,7 +2453,10 @@ namespace container
                     if ((*it)->offset > 16777215)
                         error = container_error::INDEX_CORRUPTED;
                     if ((*it)->size > 0)
+                    {
                         offset = (*it)->offset + (*it)->size;
+                        prev = *it;
+                    }
                     it++;
                 }
         }
@@ -1824,7 +2494,7 @@ namespace container
                 file->data->set_position(0);
                 return;
             }
-            catch (const container_error&)
+            catch (const std::exception&)
             {
             }
         }
@@ -1852,6 +2522,8 @@ namespace container
                 _cur_file = file;
                 return;
             }
+            else if ((*it)->offset < _cur_reader->position() || (*it)->offset == file->offset)
+                it++;
             else
             {
                 try
@@ -1867,6 +2539,103 @@ namespace container
             }
     }
 
+    bool FileContainer::read_file(const std::string& filename, std::vector<char>& buffer)
+    {
+        auto it = _index.lower_bound<std::string>(filename);
+        if (it == _index.end() || it->name != filename)
+        {
+            buffer.clear();
+            return false;
+        }
+        return read_file(*it, buffer);
+    }
+
+    bool FileContainer::read_file(const FileDesc& file, std::vector<char>& buffer)
+    {
+        auto it = _streams.find(file.stream);
+        return read_file(file, it != _streams.end() ? &it->second.chunks : nullptr, buffer);
+    }
+
+    bool FileContainer::read_file(const FileDesc& file, std::vector<Chunk>* chunks, std::vector<char>& buffer)
+    {
+        buffer.clear();
+        if (file.size < 0)
+            return false;
+        if (file.size > 0)
+        {
+            if (!_stream || _stream->is_closed() || chunks == nullptr)
+                return false;
+            try
+            {
+                PositionalReadStream stream(*_stream);
+                Reader reader(*this, file.stream, *chunks, stream);
+                if (file.offset > 0)
+                    reader.set_position(file.offset);
+                buffer.resize((size_t)file.size);
+                if (reader.read(buffer.data(), buffer.size()) != buffer.size())
+                    throw container_error("Unexpected end of stream.");
+            }
+            catch (const std::exception&)
+            {
+                buffer.clear();
+                return false;
+            }
+        }
+        if (!file.md5.empty())
+        {
+            char md5hash[33];
+            md5_raw_input(md5hash, (unsigned char *)buffer.data(), (unsigned int)buffer.size());
+            if (file.md5 != md5hash)
+            {
+                buffer.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int FileContainer::verify(int thread_count)
+    {
+        if (_stream && !_stream->is_closed() && _stream->can_write())
+            _stream->flush();
+        // The readers only use this snapshot of the index and chunk lists.
+        std::vector<FileDesc*> files;
+        std::vector<std::vector<Chunk>*> chunks;
+        for (auto& file : _index)
+        {
+            auto it = _streams.find(file.stream);
+            files.push_back((FileDesc*)&file);
+            chunks.push_back(it != _streams.end() ? &it->second.chunks : nullptr);
+        }
+        std::vector<char> corrupted(files.size(), 0);
+        std::atomic<size_t> next(0);
+
+        auto worker = [&]()
+        {
+            std::vector<char> buffer;
+            for (size_t i = next++; i < files.size(); i = next++)
+                if (!read_file(*files[i], chunks[i], buffer))
+                    corrupted[i] = 1;
+        };
+        if (thread_count < 1)
+            thread_count = 1;
+        std::vector<std::thread> threads;
+        for (int i = 1; i < thread_count; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& thread : threads)
+            thread.join();
+
+        int count = 0;
+        for (size_t i = 0; i < files.size(); i++)
+            if (corrupted[i])
+            {
+                on_corrupted(files[i], files[i]->stream);
+                count++;
+            }
+        return count;
+    }
+
     void FileContainer::close()
     {
         _stream = nullptr;
@@ -1879,7 +2648,7 @@ namespace container
             return;
         if (_stream != nullptr)
         {
-            if (_stream->can_read() == read && _stream->can_write() == write)
+            if ((!read || _stream->can_read()) && (!write || _stream->can_write()) && _stream->file_length() == _filesize)
                 return;
             close();
         }
@@ -1893,6 +2662,12 @@ namespace container
         if (_filesize != _stream->length())
         {
             _filesize = _stream->length();
+            _cur_file = nullptr;
+            _cur_reader.reset();
+            _index.clear();
+            _corrupted.clear();
+            _streams.clear();
+            _next_stream_id = 1;
             _error = open();
         }
     }
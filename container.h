@@ -15,6 +15,10 @@ typedef struct IUnknown IUnknown;
 #include <set>
 #include <map>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 namespace container
 {
@@ -201,6 +205,9 @@ namespace container
         void set_position(int64_t value) override;
         size_t read(char* buffer, size_t count) override;
         bool readline(std::string& res, int max_chars = -1);
+        int64_t file_length();
+        int descriptor();
+        int64_t offset() { return _offset; }
 
         bool can_write() { return _write; }
         void set_length(int64_t value) override;
@@ -213,10 +220,32 @@ namespace container
         bool _write;
         void* _stream = nullptr;
         bool _destroy = false;
+        int64_t _offset = 0;
         int64_t _length = -1;
         int64_t _pos = 0;
     };
 
+    // Reads at explicit offsets of the shared descriptor, each instance has its own position.
+    class PositionalReadStream : public ReadStream
+    {
+    public:
+        PositionalReadStream(FileStream& stream);
+        PositionalReadStream(const PositionalReadStream&) = delete;
+        ~PositionalReadStream();
+
+        int64_t length() override { return _length; }
+        int64_t position() override { return _pos; }
+        void set_position(int64_t value) override;
+        size_t read(char* buffer, size_t count) override;
+
+    private:
+        int _descriptor;
+        void* _handle = nullptr;
+        int64_t _offset;
+        int64_t _length;
+        int64_t _pos = 0;
+    };
+
     // Container
 
     struct FileDesc
@@ -294,7 +323,7 @@ namespace container
         size_t _buffer_size;
         std::vector<char> _buffer;
         std::string _codec_json;
-        FileContainer* _container;
+        FileContainer* _container = nullptr;
     };
 
     class Base64CoderStream : public WriteStream
@@ -360,6 +389,9 @@ namespace container
             class Index; friend class Index;
             class Stream; friend class Stream;
             WriteStream* add_file(FileDesc* file);
+            FileDesc& reset_file(const std::string& filename);
+            // Points the file to the data of an identical file already in the container.
+            void add_reference(const std::string& filename, const FileDesc& source);
 
         private:
             Packer& _packer;
@@ -382,26 +414,94 @@ namespace container
 
         Index& index() { return _index; }
         bool md5 = false;
+        // Files added from a buffer are stored as references if a live file with the same size and MD5 exists.
+        bool dedup = false;
 
     protected:
         std::unique_ptr<FileStream> _file;
         WriteStream* _stream;
         int64_t _next_id = 1;
         Index _index;
+        // Live files by (size, MD5) for dedup lookups, entries are validated on use.
+        std::map<std::pair<int64_t, std::string>, FileDesc*> _dedup;
         std::vector<std::unique_ptr<Writer>> _writers;
         FileContainer* _container = nullptr;
     };
 
+    // Unpacks a container written into it. Header parsing runs on the writing thread, codec chunks are decoded by a pool of threads,
+    // file data is delivered in container order and MD5 checked on a separate thread, on_file is called from that thread.
+    // Files referring to stream data that has already passed (deduplicated files appended later) are restored if dedup is set, otherwise listed in skipped().
     class Unpacker : public WriteStream
     {
     public:
-        Unpacker(std::function<WriteStream*(FileDesc&)> on_file) : _on_file(on_file) { }
+        Unpacker(std::function<WriteStream*(FileDesc&)> on_file, int thread_count = 0);
+        Unpacker(const Unpacker&) = delete;
+        ~Unpacker();
 
         Index& index() { return _index; }
+        const std::vector<std::string>& skipped() { return _skipped; }
+        // Keeps the data of delivered files in memory so that files referring to it can be restored.
+        bool dedup = false;
+
+        void set_length(int64_t) override { }
+        void write(const char* buffer, size_t count) override;
+        void flush() override;
+        void close() override;
+
+    private:
+        struct Job;
+        struct Output;
+        struct Segment
+        {
+            bool base64 = false;
+            std::vector<char> carry;
+        };
+        struct Delivery
+        {
+            int64_t pos = 0;
+            std::vector<Output*> files;
+        };
+
+        void start();
+        void stop();
+        void check_error();
+        void parse_header();
+        void enqueue();
+        void decode_thread();
+        void deliver_thread();
+        void deliver_index(std::vector<char>& data);
+        void deliver_data(int64_t stream_id, std::vector<char>& data);
+        void write_output(Output& output, const char* buffer, size_t count);
+        void check_output(Output& output);
+        void remove_output(const std::string& filename);
+        void restore_reference(FileDesc& file, const std::vector<char>& data);
 
     private:
         std::function<WriteStream*(FileDesc&)> _on_file;
+        int _thread_count;
         Index _index;
+        std::vector<std::string> _skipped;
+
+        int _state = 0;
+        std::string _line;
+        std::shared_ptr<Job> _job;
+        size_t _left = 0;
+        std::map<int64_t, Segment> _segments;
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<std::shared_ptr<Job>> _jobs;
+        std::deque<std::shared_ptr<Job>> _decode_queue;
+        // Jobs enqueued and not yet delivered, including the one being delivered.
+        int _in_flight = 0;
+        bool _finished = false;
+        std::exception_ptr _error;
+        std::vector<std::thread> _threads;
+
+        std::map<int64_t, Delivery> _delivery;
+        std::map<std::string, std::unique_ptr<Output>> _outputs;
+        // Data of delivered files by stream and offset, kept if dedup is set.
+        std::map<std::pair<int64_t, int64_t>, std::vector<char>> _retained;
     };
 
     class FileContainer
@@ -425,7 +525,9 @@ namespace container
             class RawReadStream;
 
         public:
-            Reader(FileContainer& container, int64_t stream_id) : _container(container), _stream_id(stream_id) { init_streams(_container._streams[_stream_id].chunks.begin()); }
+            Reader(FileContainer& container, int64_t stream_id) : Reader(container, stream_id, container._streams[stream_id].chunks, *container._stream) { }
+            // Doesn't look up the stream in the container, chunks must stay unchanged while reading.
+            Reader(FileContainer& container, int64_t stream_id, std::vector<Chunk>& chunks, ReadStream& file) : _container(container), _stream_id(stream_id), _chunks(chunks), _file(file) { init_streams(_chunks.begin()); }
 
             FileContainer& container() { return _container; }
             int64_t stream_id() { return _stream_id; }
@@ -442,6 +544,8 @@ namespace container
         private:
             FileContainer& _container;
             int64_t _stream_id;
+            std::vector<Chunk>& _chunks;
+            ReadStream& _file;
             std::vector<std::unique_ptr<ReadStream>> _streams;
             int64_t _pos = 0;
         };
@@ -456,8 +560,14 @@ namespace container
 
         FileDesc* read_file(const std::string& filename) { if (!_index.contains(filename)) return nullptr; FileDesc* file = &_index[filename]; read_file(file); return file; }
         void read_file(FileDesc* file);
+        // Safe to call from several threads while nothing is written to the container, doesn't touch the shared reader.
+        bool read_file(const std::string& filename, std::vector<char>& buffer);
+        bool read_file(const FileDesc& file, std::vector<char>& buffer);
+        // Checks MD5 hashes of all files with concurrent readers, corrupted files are removed from the index. Returns the number of corrupted files.
+        int verify(int thread_count);
 
         const std::string& filename() { return _filename; }
+        // Keeps the open stream if it allows the requested access, rescans only if the file was changed by someone else.
         void reopen(bool read = true, bool write = false);
         void close();
 
@@ -468,6 +578,7 @@ namespace container
 
         int open();
         void on_corrupted(FileDesc* file, int64_t stream_id);
+        bool read_file(const FileDesc& file, std::vector<Chunk>* chunks, std::vector<char>& buffer);
 
     private:
         std::string _filename;
@@ -481,7 +592,7 @@ namespace container
 
         std::map<int64_t, ChunkStream> _streams;
         int64_t _next_stream_id = 1;
-        int64_t _last_pos;
+        int64_t _last_pos = 0;
 
         std::unique_ptr<Reader> _cur_reader;
         FileDesc* _cur_file = nullptr;
@@ -0,0 +1,223 @@
+
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "gwnum.h"
+#include "cpuid.h"
+#include "ecm.h"
+#include "integer.h"
+#include "exception.h"
+
+using namespace arithmetic;
+
+ECMExponent::ECMExponent(uint32_t B1) : _B1(B1)
+{
+    // Prime powers packed into 32-bit words, multiplied by a product tree.
+    std::vector<Giant> level;
+    uint64_t word = 1;
+    for (auto it = PrimeIterator::get(); (uint32_t)*it <= B1; it++)
+    {
+        uint32_t p = *it;
+        int d = 1;
+        if (p >= 14)
+        {
+            int len = 60;
+            d = it.pos() < precomputed_DAC_S_d_len ? precomputed_DAC_S_d[it.pos()] : get_DAC_S_d(p, (int)(p/1.618) - 100, (int)(p/1.618) + 100, &len);
+        }
+        for (uint64_t pp = p; pp <= B1; pp *= p)
+        {
+            _dac.emplace_back(p, -d);
+            if (word*p >= (1ULL << 32))
+            {
+                level.emplace_back();
+                level.back() = (uint32_t)word;
+                word = 1;
+            }
+            word *= p;
+        }
+    }
+    level.emplace_back();
+    level.back() = (uint32_t)word;
+    while (level.size() > 1)
+    {
+        std::vector<Giant> next;
+        for (size_t i = 0; i + 1 < level.size(); i += 2)
+        {
+            next.emplace_back(std::move(level[i]));
+            next.back() *= level[i + 1];
+        }
+        if (level.size() & 1)
+            next.emplace_back(std::move(level.back()));
+        level = std::move(next);
+    }
+    _exponent = std::move(level[0]);
+
+    int len = _exponent.bitlen();
+    for (_W = 2; _W < 16 && (14 << (_W - 2)) + len/0.69*(7 + 7/(_W + 1.0)) > (14 << (_W - 1)) + len/0.69*(7 + 7/(_W + 2.0)); _W++);
+    get_NAF_W(_W, _exponent, _naf);
+}
+
+CurveFarm::CurveFarm(InputNum& input, const ECMExponent& exponent, const Stage2Plan* plan, bool dac) : _input(input), _exponent(exponent), _plan(plan), _dac(dac), _next_seed(0)
+{
+}
+
+bool CurveFarm::curve(GWArithmetic& gw, int seed, Giant& factor)
+{
+    Giant& N = *gw.state().N;
+    try
+    {
+        EdwardsArithmetic ed(gw);
+        GWNum ed_d(gw);
+        const SmallCurve* small = _small_curves != nullptr ? &(*_small_curves)[seed] : nullptr;
+        EdPoint P = small != nullptr ? ed.from_small(*small, &ed_d) : ed.gen_curve(seed, &ed_d);
+        MontgomeryArithmetic montgomery(gw, ed_d, small != nullptr ? small->d_num : 0, small != nullptr ? small->d_den : 0);
+        std::unique_ptr<EdY> Y;
+        if (_dac)
+        {
+            Y.reset(new EdY(montgomery, P));
+            for (auto& prime : _exponent.dac())
+                montgomery.mul(*Y, prime.first, prime.second, *Y);
+            // y = 1 at the neutral element.
+            GWNum tmp = Y->Z ? *Y->Y - *Y->Z : *Y->Y - 1;
+            factor = gcd(tmp, N);
+        }
+        else
+        {
+            ed.mul(P, _exponent.W(), _exponent.naf(), P);
+            factor = gcd(*P.X, N);
+            Y.reset(new EdY(montgomery, P));
+        }
+        if (factor == 1 && _plan != nullptr)
+        {
+            Logging logging(Logging::LEVEL_ERROR);
+            GWNum accumulator(gw);
+            MontgomeryStage2 stage2(*_plan);
+            stage2.run(montgomery, *Y, accumulator, 1, nullptr, logging);
+            factor = gcd(accumulator, N);
+        }
+    }
+    catch (const NoInverseException& e)
+    {
+        factor = e.divisor;
+    }
+    return factor != 1 && factor != 0 && factor != N;
+}
+
+void CurveFarm::work(GWArithmetic& gw, int index)
+{
+    try
+    {
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (Task::abort_flag())
+                    _stop = true;
+                if (_stop)
+                    break;
+            }
+            int seed = _next_seed.fetch_add(1);
+            if (seed >= _seed_end)
+                break;
+            Giant factor;
+            bool found = curve(gw, seed, factor);
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done++;
+            _ops[index] = gw.state().ops();
+            if (found && _factor == 0)
+            {
+                _factor = std::move(factor);
+                _factor_seed = seed;
+                _stop = true;
+            }
+            _cond.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _active--;
+        _cond.notify_all();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_error)
+            _error = std::current_exception();
+        _stop = true;
+        _active--;
+        _cond.notify_all();
+    }
+}
+
+bool CurveFarm::run(GWArithmetic& gw, int seed_first, int curves, int thread_count, Logging& logging)
+{
+    if (thread_count < 1)
+        thread_count = 1;
+    _next_seed = seed_first;
+    _seed_end = seed_first + curves;
+    if (_small_curves != nullptr && _seed_end > (int)_small_curves->size())
+        _seed_end = (int)_small_curves->size();
+    _done = 0;
+    _stop = false;
+    _error = nullptr;
+    _factor = 0;
+
+    // Clones are made before any worker starts, the parent state stays idle while they run.
+    std::vector<std::unique_ptr<GWState>> states;
+    std::vector<std::unique_ptr<GWArithmetic>> gws;
+    std::vector<double> ops_base;
+    for (int i = 0; i < thread_count; i++)
+    {
+        states.emplace_back(new GWState(gw.state()));
+        states.back()->thread_count = 1;
+        gws.emplace_back(new GWArithmetic(*states.back()));
+        ops_base.push_back(states.back()->ops());
+    }
+    _ops = ops_base;
+
+    std::vector<std::thread> threads;
+    _active = thread_count;
+    for (int i = 0; i < thread_count; i++)
+        threads.emplace_back(&CurveFarm::work, this, std::ref(*gws[i]), i);
+
+    auto ops = [&]()
+    {
+        double res = 0;
+        for (int i = 0; i < thread_count; i++)
+            res += _ops[i] - ops_base[i];
+        return (int)res;
+    };
+    auto last_progress = std::chrono::system_clock::now();
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_active > 0)
+    {
+        _cond.wait_for(lock, std::chrono::seconds(1));
+        if (Task::abort_flag())
+            _stop = true;
+        logging.progress().update(curves > 0 ? _done/(double)curves : 1, ops());
+        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_progress).count() >= Task::PROGRESS_TIME)
+        {
+            logging.report_progress();
+            last_progress = std::chrono::system_clock::now();
+        }
+        logging.heartbeat();
+    }
+    lock.unlock();
+    for (auto& thread : threads)
+        thread.join();
+    gws.clear();
+    states.clear();
+    if (_error)
+        std::rethrow_exception(_error);
+
+    if (_factor != 0)
+    {
+        logging.info("curve %d found a factor.\n", _factor_seed);
+        logging.report_factor(_input, _factor);
+        return true;
+    }
+    if (Task::abort_flag())
+        throw TaskAbortException();
+    logging.progress().update(1, ops());
+    logging.info("no factors in %d curves with B1=%u.\n", _done, _exponent.B1());
+    return false;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "task.h"
+#include "edwards.h"
+#include "montgomery.h"
+#include "stage2.h"
+
+// Stage 1 data for a bound B1, computed once and shared read-only by all curves of a farm.
+class ECMExponent
+{
+public:
+    ECMExponent(uint32_t B1);
+
+    uint32_t B1() const { return _B1; }
+    // Product of the maximal prime powers not exceeding B1.
+    const arithmetic::Giant& exponent() const { return _exponent; }
+    int W() const { return _W; }
+    const std::vector<int16_t>& naf() const { return _naf; }
+    // DAC chain of every prime power factor as (prime, -d), the index argument of DifferentialGroupArithmetic::mul.
+    const std::vector<std::pair<int32_t, int>>& dac() const { return _dac; }
+
+private:
+    uint32_t _B1;
+    arithmetic::Giant _exponent;
+    int _W;
+    std::vector<int16_t> _naf;
+    std::vector<std::pair<int32_t, int>> _dac;
+};
+
+// Runs ECM curves in parallel. Every worker owns a single-threaded GWState clone with its own EdwardsArithmetic,
+// seeds are taken from an atomic counter. Stage 1 uses the Edwards NAF or the Y-only DAC chains of the shared exponent,
+// stage 2 the shared plan if one is given.
+class CurveFarm
+{
+public:
+    CurveFarm(InputNum& input, const ECMExponent& exponent, const Stage2Plan* plan, bool dac = false);
+
+    // Runs curves with seeds seed_first, ..., seed_first + curves - 1 until a factor is found, the factor is reported via logging.
+    bool run(arithmetic::GWArithmetic& gw, int seed_first, int curves, int thread_count, Logging& logging);
+    // Seeds index the list of small-coefficient curves instead of gen_curve, the list must outlive the farm.
+    void set_small_curves(const std::vector<arithmetic::SmallCurve>* curves) { _small_curves = curves; }
+
+    const arithmetic::Giant& factor() { return _factor; }
+    int factor_seed() { return _factor_seed; }
+    int curves_done() { return _done; }
+
+private:
+    void work(arithmetic::GWArithmetic& gw, int index);
+    // Returns true if the curve finds a proper factor of N.
+    bool curve(arithmetic::GWArithmetic& gw, int seed, arithmetic::Giant& factor);
+
+private:
+    InputNum& _input;
+    const ECMExponent& _exponent;
+    const Stage2Plan* _plan;
+    bool _dac;
+    const std::vector<arithmetic::SmallCurve>* _small_curves = nullptr;
+
+    std::atomic<int> _next_seed;
+    int _seed_end = 0;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::vector<double> _ops;
+    int _done = 0;
+    int _active = 0;
+    bool _stop = false;
+    std::exception_ptr _error;
+    arithmetic::Giant _factor;
+    int _factor_seed = 0;
+};
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <map>
 #include "gwnum.h"
 #include "file.h"
 #include "md5.h"
@@ -303,6 +304,11 @@ bool writeThrough(char *filename, const void *buffer, size_t count)
 
 void File::commit_writer(Writer& writer)
 {
+    if (_transaction != nullptr)
+    {
+        _transaction->stage(*this, writer);
+        return;
+    }
     std::string new_filename = _filename + ".new";
     if (!writeThrough(new_filename.data(), writer.buffer().data(), writer.buffer().size()))
     {
@@ -328,10 +334,15 @@ void File::free_buffer()
 
 void File::clear(bool recursive)
 {
-    remove(_filename.data());
-    std::string md5_filename = _filename + ".md5";
-    remove(md5_filename.data());
-    std::vector<char>().swap(_buffer);
+    if (_transaction != nullptr)
+        _transaction->stage_clear(*this);
+    else
+    {
+        remove(_filename.data());
+        std::string md5_filename = _filename + ".md5";
+        remove(md5_filename.data());
+        std::vector<char>().swap(_buffer);
+    }
 
     if (recursive)
         for (auto it = _children.begin(); it != _children.end(); it++)
@@ -470,12 +481,19 @@ private:
 
 Writer* FilePacked::get_writer()
 {
+    if (_transaction != nullptr)
+        return File::get_writer();
     _container.reopen(true, true);
     return new FilePackedWriter(*this);
 }
 
 void FilePacked::commit_writer(Writer& writer)
 {
+    if (_transaction != nullptr)
+    {
+        _transaction->stage(*this, writer);
+        return;
+    }
     FilePackedWriter* f_writer = dynamic_cast<FilePackedWriter*>(&writer);
     if (f_writer != nullptr)
         f_writer->close();
@@ -484,5 +502,132 @@ void FilePacked::commit_writer(Writer& writer)
         _container.reopen(true, true);
         FilePackedWriter(*this).write(writer.buffer().data(), writer.buffer().size());
     }
-    _container.close();
+}
+
+FileTransaction::~FileTransaction()
+{
+    for (auto file : _files)
+        detach(file);
+}
+
+void FileTransaction::add(File* file)
+{
+    if (file == nullptr)
+        return;
+    _files.push_back(file);
+    file->_transaction = this;
+    for (auto& child : file->_children)
+        add(child.get());
+}
+
+void FileTransaction::detach(File* file)
+{
+    file->_transaction = nullptr;
+    for (auto& child : file->_children)
+        detach(child.get());
+}
+
+void FileTransaction::stage(File& file, Writer& writer)
+{
+    for (auto it = _staged.begin(); it != _staged.end(); it++)
+        if (it->first == &file)
+        {
+            _staged.erase(it);
+            break;
+        }
+    _staged.emplace_back(&file, new Writer(std::move(writer.buffer())));
+}
+
+void FileTransaction::stage_clear(File& file)
+{
+    for (auto it = _staged.begin(); it != _staged.end(); it++)
+        if (it->first == &file)
+        {
+            _staged.erase(it);
+            break;
+        }
+    _staged.emplace_back(&file, nullptr);
+}
+
+bool FileTransaction::commit()
+{
+    std::vector<std::pair<File*, std::unique_ptr<Writer>>> staged(std::move(_staged));
+    _staged.clear();
+
+    std::map<container::FileContainer*, std::vector<std::pair<File*, std::unique_ptr<Writer>>*>> packed;
+    std::vector<std::pair<File*, std::unique_ptr<Writer>>*> plain;
+    for (auto& entry : staged)
+    {
+        FilePacked* file = dynamic_cast<FilePacked*>(entry.first);
+        if (file != nullptr)
+            packed[&file->container()].push_back(&entry);
+        else
+            plain.push_back(&entry);
+    }
+
+    // Packed files go first, no plain file is touched if an append fails.
+    for (auto& [container, files] : packed)
+    {
+        try
+        {
+            container->reopen(true, true);
+            container::Packer packer(*container);
+            packer.md5 = true;
+            packer.dedup = dedup;
+            container::Packer::Writer& writer = packer.add_writer();
+            for (auto& entry : files)
+                if (entry->second)
+                    writer.add_file(entry->first->_filename, entry->second->buffer().data(), entry->second->buffer().size());
+                else
+                    writer.add_file(entry->first->_filename, nullptr, 0);
+            writer.close();
+            packer.close();
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+
+    for (auto& entry : plain)
+    {
+        if (!entry->second)
+            continue;
+        std::string new_filename = entry->first->_filename + ".new";
+        if (!writeThrough(new_filename.data(), entry->second->buffer().data(), entry->second->buffer().size()))
+        {
+            for (auto& entry_new : plain)
+                if (entry_new->second)
+                    remove((entry_new->first->_filename + ".new").data());
+            return false;
+        }
+    }
+
+    for (auto& [container, files] : packed)
+        for (auto& entry : files)
+            if (entry->second)
+                entry->first->_buffer = std::move(entry->second->buffer());
+            else
+                std::vector<char>().swap(entry->first->_buffer);
+    for (auto& entry : plain)
+    {
+        File* file = entry->first;
+        if (!entry->second)
+        {
+            remove(file->_filename.data());
+            remove((file->_filename + ".md5").data());
+            std::vector<char>().swap(file->_buffer);
+            continue;
+        }
+        std::string new_filename = file->_filename + ".new";
+        remove(file->_filename.data());
+        rename(new_filename.data(), file->_filename.data());
+        if (file->hash)
+        {
+            std::string hash = entry->second->hash_str();
+            writeThrough(file->_hash_filename.data(), hash.data(), 32);
+        }
+        file->_buffer = std::move(entry->second->buffer());
+    }
+    return true;
 }
@@ -78,6 +78,7 @@ private:
 };
 
 class TaskState;
+class FileTransaction;
 
 class File
 {
@@ -118,11 +119,13 @@ public:
     int appid = FILE_APPID;
 
 protected:
+    friend class FileTransaction;
     std::string _filename;
     std::string _hash_filename;
     uint32_t _fingerprint;
     std::vector<char> _buffer;
     std::vector<std::unique_ptr<File>> _children;
+    FileTransaction* _transaction = nullptr;
 };
 
 class FileEmpty : public File
@@ -154,4 +157,32 @@ public:
 
 private:
     container::FileContainer& _container;
-};
\ No newline at end of file
+};
+
+// Stages writes to the added files and their children, commit() writes them all at once.
+// Packed files of the same container go into one append with one index block, plain files are renamed only after all of them are written.
+// Staged writes and clears are dropped if the transaction is destroyed without commit(). commit() returns false if any file could not be written,
+// plain files are then left unchanged.
+class FileTransaction
+{
+public:
+    FileTransaction() { }
+    FileTransaction(const FileTransaction&) = delete;
+    ~FileTransaction();
+
+    void add(File* file);
+    void stage(File& file, Writer& writer);
+    // The file is removed at commit, packed files are replaced by an empty entry.
+    void stage_clear(File& file);
+    bool commit();
+
+    // Identical payloads of packed files are stored as references, which older readers and the streaming Unpacker can't restore.
+    bool dedup = false;
+
+private:
+    void detach(File* file);
+
+private:
+    std::vector<File*> _files;
+    std::vector<std::pair<File*, std::unique_ptr<Writer>>> _staged;
+};
@@ -17,6 +17,43 @@
 
 using namespace arithmetic;
 
+bool InputNum::PRESCREEN = true;
+
+bool read_factors(Reader& reader, std::vector<std::pair<Giant, int>>& factors, Giant& cofactor)
+{
+    int32_t count, exp;
+    factors.clear();
+    if (!reader.read(count) || count < 0)
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        Giant factor;
+        if (!reader.read(factor) || !reader.read(exp))
+            return false;
+        factors.emplace_back(std::move(factor), exp);
+    }
+    if (!reader.read(count))
+        return false;
+    if (!cofactor.empty())
+        cofactor.arithmetic().free(cofactor);
+    if (count != 0 && !reader.read(cofactor))
+        return false;
+    return true;
+}
+
+void write_factors(Writer& writer, std::vector<std::pair<Giant, int>>& factors, Giant& cofactor)
+{
+    writer.write((int32_t)factors.size());
+    for (auto& factor : factors)
+    {
+        writer.write(factor.first);
+        writer.write((int32_t)factor.second);
+    }
+    writer.write((int32_t)(cofactor.empty() ? 0 : 1));
+    if (!cofactor.empty())
+        writer.write(cofactor);
+}
+
 bool InputNum::read(File& file)
 {
     std::unique_ptr<Reader> reader(file.get_reader());
@@ -24,24 +61,133 @@ bool InputNum::read(File& file)
         return false;
     if (reader->type() != 0)
         return false;
-    if (!reader->read(_gb))
+    Giant N;
+    if (!reader->read(N))
         return false;
-    _type = GENERIC;
-    _gk = 1;
-    _n = 0;
-    _c = 0;
-    _input_text = file.filename();
-    _display_text = file.filename();
+    if (reader->version() == 0)
+    {
+        _value_valid = false;
+        _bitlen = -1;
+        _special_checked = false;
+        _type = GENERIC;
+        _gk = 1;
+        _gb = std::move(N);
+        _n = 0;
+        _gd = 1;
+        _c = 0;
+        _factors.clear();
+        if (!_cofactor.empty())
+            _cofactor.arithmetic().free(_cofactor);
+        _b_factors.clear();
+        if (!_b_cofactor.empty())
+            _b_cofactor.arithmetic().free(_b_cofactor);
+        _input_text = file.filename();
+        _display_text = file.filename();
+        _custom_k.clear();
+        _custom_b.clear();
+        _custom_d.clear();
+        _gfn = 0;
+        _multifactorial = 0;
+        _cyclotomic_k = 0;
+        _hex_k = 0;
+        return true;
+    }
+
+    if (reader->version() != 1)
+        return false;
+
+    int32_t type, c, multifactorial, gfn, cyclotomic_k, hex_k;
+    uint32_t n;
+    Giant gk, gb, gd;
+    std::string input_text, display_text, custom_k, custom_b, custom_d;
+    std::vector<std::pair<Giant, int>> factors, b_factors;
+    Giant cofactor, b_cofactor;
+    if (!reader->read(type) || !reader->read(gk) || !reader->read(gb) || !reader->read(n) || !reader->read(gd) || !reader->read(c) || !reader->read(multifactorial))
+        return false;
+    if (!reader->read(input_text) || !reader->read(display_text) || !reader->read(custom_k) || !reader->read(custom_b) || !reader->read(custom_d))
+        return false;
+    if (!read_factors(*reader, factors, cofactor) || !read_factors(*reader, b_factors, b_cofactor))
+        return false;
+    if (!reader->read(gfn) || !reader->read(cyclotomic_k) || !reader->read(hex_k))
+        return false;
+    if (type != GENERIC && type != KBNC && type != FACTORIAL && type != PRIMORIAL)
+        return false;
+
+    // The restored fields must give the stored value, k*b^n + c before the division by d.
+    for (uint32_t modulus : {3417905339U, 4294967291U})
+    {
+        uint64_t result = gb%modulus;
+        if (type == KBNC)
+        {
+            uint64_t base = result;
+            result = 1;
+            for (uint32_t i = n; i > 0; i >>= 1, base = base*base%modulus)
+                if (i & 1)
+                    result = result*base%modulus;
+        }
+        result = result*(gk%modulus)%modulus;
+        result = (result + modulus + (c >= 0 ? (uint64_t)c%modulus : modulus - (uint64_t)(-(int64_t)c)%modulus))%modulus;
+        if (result != N%modulus)
+            return false;
+    }
+
+    _value_valid = false;
+    _bitlen = -1;
+    _special_checked = false;
+    _type = type;
+    _gk = std::move(gk);
+    _gb = std::move(gb);
+    _n = n;
+    _gd = std::move(gd);
+    _c = c;
+    _multifactorial = multifactorial;
+    _input_text = std::move(input_text);
+    _display_text = std::move(display_text);
+    _custom_k = std::move(custom_k);
+    _custom_b = std::move(custom_b);
+    _custom_d = std::move(custom_d);
+    _factors = std::move(factors);
+    _cofactor = std::move(cofactor);
+    _b_factors = std::move(b_factors);
+    _b_cofactor = std::move(b_cofactor);
+    _gfn = gfn;
+    _cyclotomic_k = cyclotomic_k;
+    _hex_k = hex_k;
+    if (_gd == 1)
+    {
+        _value = std::move(N);
+        _value_valid = true;
+    }
     return true;
 }
 
+// Version 1 keeps the version 0 value in front and appends the processed fields, so resume doesn't need to factorize k, b and d again.
 void InputNum::write(File& file)
 {
-    std::unique_ptr<Writer> writer(file.get_writer(0, 0));
-    if (_type != KBNC)
+    std::unique_ptr<Writer> writer(file.get_writer(0, 1));
+    if (_gd == 1)
+        writer->write(value());
+    else if (_type != KBNC)
         writer->write(_gk*_gb + _c);
     else
         writer->write(_gk*power(_gb, _n) + _c);
+    writer->write((int32_t)_type);
+    writer->write(_gk);
+    writer->write(_gb);
+    writer->write(_n);
+    writer->write(_gd);
+    writer->write(_c);
+    writer->write((int32_t)_multifactorial);
+    writer->write(_input_text);
+    writer->write(_display_text);
+    writer->write(_custom_k);
+    writer->write(_custom_b);
+    writer->write(_custom_d);
+    write_factors(*writer, _factors, _cofactor);
+    write_factors(*writer, _b_factors, _b_cofactor);
+    writer->write((int32_t)_gfn);
+    writer->write(_cyclotomic_k);
+    writer->write(_hex_k);
     file.commit_writer(*writer);
 }
 
@@ -205,7 +351,7 @@ bool InputNum::parse(const std::string& s, bool c_required)
             }
             if (recursive.k() != 1)
             {
-                gk *= recursive.gk();
+                gk *= recursive._gk;
                 custom_k += "*" + recursive.gk().to_string();
             }
             gb = recursive.gb();
@@ -238,7 +384,7 @@ bool InputNum::parse(const std::string& s, bool c_required)
             gk += recursive._c;
             if (recursive.k() != 1)
             {
-                gk *= recursive.gk();
+                gk *= recursive._gk;
                 custom_k = "*" + recursive.gk().to_string();
             }
             gb = recursive.gb();
@@ -251,13 +397,15 @@ bool InputNum::parse(const std::string& s, bool c_required)
             hex_k = (recursive.k() > 0 && recursive.k() < 32 && recursive.d() == 1 ? recursive.k() : 0)*recursive._c;
             if (type == KBNC)
             {
-                if (recursive.gk()%3 == 0)
-                    recursive.gk() /= 3;
+                if (recursive._gk%3 == 0)
+                    recursive._gk /= 3;
                 else
                 {
-                    recursive.gk() *= recursive.gb()/3;
+                    recursive._gk *= recursive._gb/3;
                     recursive._n--;
                 }
+                recursive._value_valid = false;
+                recursive._bitlen = -1;
                 custom_k = "(" + recursive.build_text() + ")" + custom_k;
             }
             else if (type == FACTORIAL || type == PRIMORIAL)
@@ -675,6 +823,9 @@ void factorize(Giant& N, std::vector<std::pair<arithmetic::Giant, int>>& factors
 
 void InputNum::process()
 {
+    _value_valid = false;
+    _bitlen = -1;
+    _special_checked = false;
     _factors.clear();
     if (!_cofactor.empty())
         _cofactor.arithmetic().free(_cofactor);
@@ -906,15 +1057,168 @@ std::string InputNum::build_text(int max_len)
     return res;
 }
 
+// Runs the extended Euclid of find_special_form on the top 128 bits of B and r. Truncation changes m*r - p*B by at most 2m + 1,
+// so a small c in the full numbers shows up as a small c here at the same m. Returns false if no m qualifies.
+bool special_form_candidate(Giant& B, Giant& r, uint64_t max_m, int32_t max_c)
+{
+    int shift = B.bitlen() - 128;
+    if (shift <= 0)
+        return true;
+    Giant c0, c1, a;
+    c0 = B;
+    c0 >>= shift;
+    c1 = r;
+    c1 >>= shift;
+    int64_t m0 = 0, m1 = 1;
+    while ((uint64_t)std::abs(m1) <= max_m)
+    {
+        if (c1.bitlen() < 32 && c1 <= (int32_t)(2*std::abs(m1) + 2 + (max_c >> (shift < 31 ? shift : 31))))
+            return true;
+        a = c0/c1;
+        if (a.bitlen() > 32)
+            break;
+        uint32_t q = *a.data();
+        c0 -= c1*q;
+        std::swap(c0, c1);
+        m0 -= m1*q;
+        std::swap(m0, m1);
+    }
+    return false;
+}
+
+bool InputNum::find_special_form()
+{
+    // Looks for m*N = k*b^n+c with small m, k, c, so N can use the special form FFT with known_factors = m.
+    const uint64_t MAX_M = 1 << 20;
+    const int32_t MAX_C = 1 << 20;
+    const int MAX_K_BITS = 40;
+
+    if (_special_checked)
+        return _special_b != 0;
+    _special_checked = true;
+    _special_b = 0;
+    if (_type == ZERO || (_type == KBNC && (_cyclotomic_k != 0 || _hex_k != 0 || (k() != 0 && b() != 0 && d() == 1))))
+        return false;
+    if (_type == KBNC && k() != 0 && k() < (1ULL << MAX_K_BITS) && b() != 0 && d() != 0 && (uint64_t)abs(_c)*d() < (uint64_t)MAX_C)
+    {
+        _special_m = _gd;
+        _special_k = k();
+        _special_b = b();
+        _special_n = _n;
+        _special_c = _c*(int32_t)d();
+        return true;
+    }
+
+    update_value();
+    Giant& N = _value;
+    if (N.bitlen() < 2*MAX_K_BITS)
+        return false;
+    Giant B, Q, r, c0, c1, a, tmp;
+    unsigned long best_fftlen = 0;
+    for (uint32_t b : {2, 3, 5, 6, 7, 10, 11, 12})
+    {
+        double log2b = log2(b);
+        int n = (int)(N.bitlen()/log2b);
+        B = b;
+        B.power(n);
+        for (int i = 0; i <= MAX_K_BITS/log2b && n > 1; i++, n--, B /= b)
+        {
+            if (B > N)
+                continue;
+            Q = N/B;
+            r = N - Q*B;
+            if (!special_form_candidate(B, r, MAX_M, MAX_C))
+                continue;
+            // Extended Euclid on (B, r) keeps c = m*r - p*B, so m*N = (m*Q + p)*B + c.
+            int64_t m0 = 0, p0 = -1, m1 = 1, p1 = 0;
+            c0 = B;
+            c1 = r;
+            while (c1 != 0 && (uint64_t)std::abs(m1) <= MAX_M)
+            {
+                if (c1.bitlen() < 32 && c1 <= MAX_C)
+                {
+                    int32_t c = (int32_t)*c1.data()*(m1 < 0 ? -1 : 1);
+                    tmp = Q*(uint32_t)std::abs(m1);
+                    if (m1*p1 >= 0)
+                        tmp += (uint32_t)std::abs(p1);
+                    else
+                        tmp -= (uint32_t)std::abs(p1);
+                    if (tmp > 0 && tmp.bitlen() <= MAX_K_BITS)
+                    {
+                        uint64_t k = tmp.size() > 1 ? *(uint64_t*)tmp.data() : *tmp.data();
+                        int kn = n;
+                        for (; k%b == 0; k /= b, kn++);
+                        unsigned long fftlen = gwmap_to_fftlen((double)k, b, kn, c);
+                        if (fftlen != 0 && (best_fftlen == 0 || fftlen < best_fftlen))
+                        {
+                            best_fftlen = fftlen;
+                            _special_m = (uint32_t)std::abs(m1);
+                            _special_k = k;
+                            _special_b = b;
+                            _special_n = kn;
+                            _special_c = c;
+                        }
+                    }
+                }
+                a = c0/c1;
+                if (a.bitlen() > 32)
+                    break;
+                uint32_t q = *a.data();
+                c0 -= c1*q;
+                std::swap(c0, c1);
+                m0 -= m1*q;
+                std::swap(m0, m1);
+                p0 -= p1*q;
+                std::swap(p0, p1);
+            }
+        }
+    }
+
+    return _special_b != 0;
+}
+
+std::string InputNum::special_form_text()
+{
+    if (!find_special_form())
+        return "";
+    std::string res;
+    if (_special_m != 1)
+        res = "(";
+    if (_special_k != 1)
+        res += std::to_string(_special_k) + "*";
+    res += std::to_string(_special_b) + "^" + std::to_string(_special_n);
+    if (_special_c > 0)
+        res += "+";
+    res += std::to_string(_special_c);
+    if (_special_m != 1)
+        res += ")/" + _special_m.to_string();
+    return res;
+}
+
 void InputNum::setup(GWState& state)
 {
+    if (!state.force_mod_type && find_special_form())
+    {
+        state.known_factors = _special_m;
+        state.setup(_special_k, _special_b, _special_n, _special_c);
+        if (*state.N%3417905339UL != fingerprint())
+            throw ArithmeticException();
+        if (state.gwdata()->GENERAL_MOD || state.gwdata()->GENERAL_MMGW_MOD)
+        {
+            state.done();
+            state.known_factors = 1;
+            _special_b = 0;
+            setup(state);
+        }
+        return;
+    }
     if (_type == GENERIC)
     {
         state.setup(_gb);
     }
     else if (_type != KBNC)
     {
-        state.setup(_gk*_gb/_gd + _c);
+        state.setup(value());
     }
     else if ((_cyclotomic_k != 0 || _hex_k != 0) && b() != 0 && !state.force_mod_type)
     {
@@ -927,7 +1231,8 @@ void InputNum::setup(GWState& state)
         if (_hex_k != 0)
         {
             Giant x = (-_hex_k)*power(_gb, _n);
-            Giant val = value() + x;
+            update_value();
+            Giant val = _value + x;
             state.known_factors = (val + std::move(x))*val;
             uint64_t hex_k = (uint64_t)(_hex_k*_hex_k);
             if (hex_k%3 == 0)
@@ -949,25 +1254,54 @@ void InputNum::setup(GWState& state)
     }
     else if (k() != 0 && b() != 0 && d() == 1)
     {
-        state.setup(k(), b(), _n, _c);
+        state.setup(k(), b(), _n, _c, _value_valid ? &_value : nullptr);
+        if (!_value_valid && (state.known_factors.empty() || state.known_factors == 1))
+        {
+            _value = *state.N;
+            _value_valid = true;
+        }
     }
     else
     {
-        state.setup(_gk*power(_gb, _n)/_gd + _c);
+        state.setup(value());
     }
     if (state.fingerprint != fingerprint())
         throw ArithmeticException();
 }
 
+arithmetic::Giant InputNum::value()
+{
+    update_value();
+    return _value;
+}
+
+void InputNum::update_value()
+{
+    if (!_value_valid)
+    {
+        if (_type == GENERIC)
+            _value = _gb;
+        else if (_type != KBNC)
+            _value = _gk*_gb/_gd + _c;
+        else
+            _value = _gk*power(_gb, _n)/_gd + _c;
+        _value_valid = true;
+    }
+}
+
 int InputNum::bitlen()
 {
+    if (_bitlen >= 0)
+        return _bitlen;
     if (_type == GENERIC)
-        return _gb.bitlen();
+        _bitlen = _gb.bitlen();
     else if (_type != KBNC)
-        return _gk.bitlen() + _gb.bitlen() - _gd.bitlen();
+        _bitlen = _gk.bitlen() + _gb.bitlen() - _gd.bitlen();
     else if (b() == 2)
-        return _gk.bitlen() + _n - _gd.bitlen() + 1;
-    return (int)std::ceil(log2(_gk) + log2(_gb)*_n - log2(_gd));
+        _bitlen = _gk.bitlen() + _n - _gd.bitlen() + 1;
+    else
+        _bitlen = (int)std::ceil(log2(_gk) + log2(_gb)*_n - log2(_gd));
+    return _bitlen;
 }
 
 uint64_t InputNum::parse_numeral(const std::string& s)
@@ -1053,6 +1387,148 @@ uint32_t InputNum::mod(uint32_t modulus)
     return (uint32_t)(result%modulus);
 }
 
+bool InputNum::prescreen(std::string& reason)
+{
+    reason.clear();
+    if (_type == ZERO)
+        return true;
+    int len = bitlen();
+    bool direct = _gd == 1;
+    Giant* N = nullptr;
+    if (len < 64 || !direct)
+    {
+        update_value();
+        N = &_value;
+    }
+    auto residue = [&](uint32_t q) { return N == nullptr ? mod(q) : *N%q; };
+    if (len < 64 && *N < 2)
+    {
+        reason = "less than 2";
+        return false;
+    }
+
+    // Common factors of c and k*b.
+    if (_type != GENERIC && _c != 0 && abs(_c) != 1)
+    {
+        Giant g;
+        g = abs(_c);
+        Giant kb = _gk*_gb;
+        g.gcd(kb);
+        if (_gd > 1)
+            for (Giant t = gcd(g, _gd); t > 1; t = gcd(g, _gd))
+                g /= t;
+        if (g > 1 && (len >= 64 || g != *N))
+        {
+            reason = "divisible by " + g.to_string();
+            return false;
+        }
+    }
+    PrimeIterator primes = PrimeIterator::get();
+    for (; *primes < 64; primes++)
+        if (residue(*primes) == 0 && (len >= 64 || *N != *primes))
+        {
+            reason = "divisible by " + std::to_string(*primes);
+            return false;
+        }
+
+    // Algebraic factors of X^E+-1, where k*b^n = X^E.
+    if (_type == KBNC && direct && _cofactor.empty() && abs(_c) == 1 && !_factors.empty())
+    {
+        int E = 0;
+        for (auto& factor : _factors)
+            if (factor.second > 0)
+                E = E == 0 ? factor.second : gcd(E, factor.second);
+        int p;
+        for (p = 2; p < E && E%p != 0; p++);
+        auto X_text = [&](int exp)
+        {
+            Giant X;
+            X = 1;
+            for (auto& factor : _factors)
+                if (factor.second > 0)
+                    X *= power(factor.first, factor.second/E);
+            std::string res = X.bitlen() < 64 ? X.to_string() : "(" + build_text(20) + ")^(1/" + std::to_string(E) + ")";
+            return exp > 1 ? res + "^" + std::to_string(exp) : res;
+        };
+        if (_c == -1 && E > 1 && !(E == p && _factors.size() == 1 && _factors[0].first == 2 && _factors[0].second == E))
+        {
+            reason = "algebraic factor " + X_text(E/p) + "-1";
+            return false;
+        }
+        if (_c == 1 && E > 1)
+        {
+            for (p = 3; p <= E && E%p != 0; p += 2);
+            if (p <= E)
+            {
+                reason = "algebraic factor " + X_text(E/p) + "+1";
+                return false;
+            }
+        }
+        // 4y^4+1 = (2y^2+2y+1)(2y^2-2y+1)
+        if (_c == 1)
+        {
+            bool aurifeuillian = len > 3;
+            for (auto& factor : _factors)
+                if (factor.second > 0 && (factor.first == 2 ? factor.second%4 != 2 : factor.second%4 != 0))
+                    aurifeuillian = false;
+            if (aurifeuillian && _factors[0].first == 2)
+            {
+                reason = "Aurifeuillian factorization 4y^4+1";
+                return false;
+            }
+        }
+    }
+
+    // Perfect powers. N^((q-1)/e) must be 0 or 1 mod q for q = 1 mod e, the integer root is checked only when all residues pass.
+    int max_e = _type == GENERIC && len > (1 << 16) ? std::max(64, (1 << 28)/len) : std::min(len, 1 << 16);
+    for (primes = PrimeIterator::get(); *primes <= max_e; primes++)
+    {
+        uint32_t e = *primes;
+        int passed = 0;
+        for (uint64_t q = 2*(uint64_t)e + 1; passed < 5 && q < (1ULL << 31); q += 2*e)
+        {
+            if (!is_prime((uint32_t)q))
+                continue;
+            uint64_t r = residue((uint32_t)q);
+            uint64_t x = 1;
+            for (uint64_t exp = (q - 1)/e; exp > 0; exp >>= 1, r = r*r%q)
+                if (exp & 1)
+                    x = x*r%q;
+            if (x > 1)
+                break;
+            passed++;
+        }
+        if (passed < 5)
+            continue;
+        if (N == nullptr)
+        {
+            update_value();
+            N = &_value;
+        }
+        Giant x;
+        x = 1;
+        x <<= (N->bitlen() + e - 1)/e;
+        while (true)
+        {
+            Giant t = power(x, e - 1);
+            Giant y = *N;
+            y /= t;
+            y += x*(int32_t)(e - 1);
+            y /= (int32_t)e;
+            if (y >= x)
+                break;
+            x = std::move(y);
+        }
+        if (power(x, e) == *N)
+        {
+            reason = "perfect power " + (x.bitlen() < 64 ? x.to_string() : "x") + "^" + std::to_string(e);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool InputNum::is_half_factored()
 {
     if (abs(_c) != 1)
@@ -1076,7 +1552,8 @@ std::vector<int> InputNum::factorize_minus1(int depth)
     uint32_t s = (depth + 1)/2;
     if (s%2 == 1)
         s++;
-    Giant minus1 = value() - 1;
+    update_value();
+    Giant minus1 = _value - 1;
     std::vector<std::pair<arithmetic::Giant, int>> factors;
     factorize(minus1, factors, minus1, [&](Giant& x, uint32_t p) { return mod(p) == 1; }, s);
 
@@ -1099,12 +1576,21 @@ void InputNum::print_info()
     if (_type == ZERO)
         return;
 
-    Giant N = value();
+    update_value();
+    Giant& N = _value;
     Giant tmp;
     std::string st;
 
     std::cout << display_text() << ", " << N.bitlen() << " bits, " << N.digits() << " digits." << std::endl;
 
+    if (find_special_form())
+    {
+        // General mod is either Barrett on an FFT of twice the size or MMGW, whichever is cheaper, weighted as in GWState::ops().
+        double generic_cost = std::min(gwmap_to_fftlen(1.0, 2, 2*N.bitlen() + 32, -1)*6.0, gwmap_to_fftlen(1.0, 2, N.bitlen() + 32, -1)*7.5);
+        double special_cost = gwmap_to_fftlen((double)_special_k, _special_b, _special_n, _special_c)*2.0;
+        std::cout << "Special form: " << special_form_text() << ", estimated speedup " << std::fixed << std::setprecision(1) << generic_cost/special_cost << "x." << std::defaultfloat << std::endl;
+    }
+
     std::vector<std::pair<arithmetic::Giant, int>> factors;
     arithmetic::Giant cofactor;
     factorize(N, factors, cofactor, [&](Giant& x, uint32_t p) { return mod(p) == 0; });
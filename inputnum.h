@@ -15,6 +15,8 @@ public:
     static const int KBNC = 2;
     static const int FACTORIAL = 3;
     static const int PRIMORIAL = 4;
+    // Primality tests call prescreen() before setup and skip the numbers it rejects.
+    static bool PRESCREEN;
 
 public:
     InputNum() { _gk = 0; _gb = 0; _gd = 1; }
@@ -31,6 +33,8 @@ public:
     bool parse(const std::string& s, bool c_required = true);
     void setup(arithmetic::GWState& state);
     void print_info();
+    bool find_special_form();
+    std::string special_form_text();
 
     //deprecated
     static uint64_t parse_numeral(const std::string& s);
@@ -42,16 +46,19 @@ public:
     uint32_t n() { return _type == KBNC ? _n : 1; }
     uint32_t d() { return _gd.size() == 1 ? *(_gd.data()) : 0; }
     int32_t c() { return _c; }
-    arithmetic::Giant& gk() { return _gk; }
-    arithmetic::Giant& gb() { return _gb; }
-    arithmetic::Giant& gd() { return _gd; }
+    arithmetic::Giant gk() const { return _gk; }
+    arithmetic::Giant gb() const { return _gb; }
+    arithmetic::Giant gd() const { return _gd; }
     int gfn() { return _gfn; }
     int multifactorial() { return _multifactorial; }
     int cyclotomic() { return _cyclotomic_k; }
     int hex() { return _hex_k; }
-    arithmetic::Giant value() { return _type == GENERIC ? _gb : _type != KBNC ? _gk*_gb/_gd + _c : _gk*power(_gb, _n)/_gd + _c; }
+    // Computed on first use and kept until the number changes.
+    arithmetic::Giant value();
     uint32_t mod(uint32_t modulus);
     uint32_t fingerprint() { return mod(3417905339UL); }
+    // Cheap checks for numbers which can't be prime, sets reason if the number is rejected.
+    bool prescreen(std::string& reason);
 
     int bitlen();
 
@@ -68,6 +75,8 @@ public:
 
 private:
     void process();
+    // Fills _value if the number has changed.
+    void update_value();
     std::string build_text(int max_len = -1);
 
 private:
@@ -90,4 +99,13 @@ private:
     int _multifactorial = 0;
     int32_t _cyclotomic_k = 0;
     int32_t _hex_k = 0;
+    arithmetic::Giant _value;
+    bool _value_valid = false;
+    int _bitlen = -1;
+    bool _special_checked = false;
+    arithmetic::Giant _special_m;
+    uint64_t _special_k = 0;
+    uint32_t _special_b = 0;
+    uint32_t _special_n = 0;
+    int32_t _special_c = 0;
 };
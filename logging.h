@@ -81,6 +81,7 @@ public:
     virtual bool state_save_flag() { return false; }
     virtual void state_save() { }
     virtual void progress_save();
+    virtual void progress_transaction(FileTransaction& transaction) { transaction.add(_file_progress); }
     virtual void heartbeat() { }
 
     virtual void file_progress(File* file_progress);
@@ -116,6 +117,7 @@ public:
     virtual void report_param(const std::string& name, double value) override { Logging::report_param(name, value); _parent.report_param(name, value); }
     virtual void report_factor(InputNum& input, const arithmetic::Giant& f) override { _parent.report_factor(input, f); }
     virtual void progress_save() override { Logging::progress_save(); _parent.progress_save(); }
+    virtual void progress_transaction(FileTransaction& transaction) override { Logging::progress_transaction(transaction); _parent.progress_transaction(transaction); }
     virtual void heartbeat() override { _parent.heartbeat(); }
 
 protected:
@@ -0,0 +1,597 @@
+
+#include <cmath>
+#include <cinttypes>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "gwnum.h"
+#include "cpuid.h"
+#include "sieve.h"
+#include "integer.h"
+
+using namespace arithmetic;
+
+bool SieveState::read(Reader& reader)
+{
+    if (!TaskState::read(reader))
+        return false;
+    uint32_t size;
+    if (!reader.read(_prime) || !reader.read(size))
+        return false;
+    _bitmap.resize(size);
+    for (auto it = _bitmap.begin(); it != _bitmap.end(); it++)
+        if (!reader.read(*it))
+            return false;
+    return true;
+}
+
+void SieveState::write(Writer& writer)
+{
+    TaskState::write(writer);
+    writer.write(_prime);
+    writer.write((uint32_t)_bitmap.size());
+    writer.write((const char*)_bitmap.data(), _bitmap.size()*sizeof(uint64_t));
+}
+
+int Sieve::PRIMES_PER_THREAD = 65536;
+
+Sieve::Sieve(uint32_t size) : _size(size)
+{
+    _bitmap.resize((size + 63)/64, ~0ULL);
+    if (size & 63)
+        _bitmap.back() = (1ULL << (size & 63)) - 1;
+}
+
+int Sieve::count()
+{
+    int res = 0;
+    for (auto it = _bitmap.begin(); it != _bitmap.end(); it++)
+        for (uint64_t w = *it; w != 0; w &= w - 1)
+            res++;
+    return res;
+}
+
+void Sieve::write_candidates(File& file)
+{
+    std::unique_ptr<Writer> writer(file.get_writer());
+    for (uint32_t i = 0; i < _size; i++)
+        if (bit(i))
+            writer->write_textline(text(i));
+    file.commit_writer(*writer);
+}
+
+KBNCSieve::KBNCSieve(uint64_t k, uint32_t b, uint32_t n_min, uint32_t n_max, int32_t c) : Sieve(n_min <= n_max ? n_max - n_min + 1 : 0), _k(k), _b(b), _n_min(n_min), _n_max(n_max), _c(c)
+{
+    if (k == 0 || b < 2 || n_min > n_max || k >= (1ULL << 63))
+        throw std::invalid_argument("Invalid sieve parameters.");
+}
+
+uint32_t KBNCSieve::fingerprint()
+{
+    return File::unique_fingerprint((uint32_t)_k, candidate_text(_n_min) + ".." + std::to_string(_n_max));
+}
+
+std::string KBNCSieve::candidate_text(uint32_t n)
+{
+    std::string res;
+    if (_k != 1)
+        res = std::to_string(_k) + "*";
+    res += std::to_string(_b) + "^" + std::to_string(n);
+    if (_c >= 0)
+        res += "+";
+    res += std::to_string(_c);
+    return res;
+}
+
+std::vector<uint32_t> KBNCSieve::candidates()
+{
+    std::vector<uint32_t> res;
+    for (uint32_t n = _n_min; n <= _n_max; n++)
+        if (is_candidate(n))
+            res.push_back(n);
+    return res;
+}
+
+void KBNCSieve::sieve_small()
+{
+    // Values that fit in 64 bits are checked directly, so primes are not struck out by themselves.
+    bool even = ((_k & 1) && (_b & 1)) == ((_c & 1) != 0);
+    for (uint32_t n = _n_min; n <= _n_max; n++)
+    {
+        if (std::log2((double)_k) + n*std::log2((double)_b) > 62)
+        {
+            if (even && n > 0)
+                clear(_bitmap, n - _n_min);
+            continue;
+        }
+        uint64_t val = _k;
+        for (uint32_t i = 0; i < n; i++)
+            val *= _b;
+        int64_t v = (int64_t)val + _c;
+        if (v < 2 || (!(v & 1) && v != 2))
+            clear(_bitmap, n - _n_min);
+    }
+}
+
+void KBNCSieve::sieve(const uint64_t* primes, size_t count, std::vector<uint64_t>& bitmap)
+{
+    uint32_t range = _n_max - _n_min + 1;
+    uint32_t m = (uint32_t)std::sqrt((double)range) + 1;
+    size_t hash_size;
+    for (hash_size = 1; hash_size < 2*(size_t)m; hash_size <<= 1);
+    int hash_shift = 64;
+    for (size_t i = hash_size; i > 1; i >>= 1, hash_shift--);
+    std::vector<uint64_t> keys(hash_size);
+    std::vector<uint32_t> values(hash_size);
+    auto hash = [&](uint64_t key) { return (size_t)((key*0x9E3779B97F4A7C15ULL) >> hash_shift) & (hash_size - 1); };
+    auto lookup = [&](uint64_t key)
+    {
+        for (size_t h = hash(key); values[h] != UINT32_MAX; h = (h + 1) & (hash_size - 1))
+            if (keys[h] == key)
+                return values[h];
+        return UINT32_MAX;
+    };
+    // Below this n the value fits in 64 bits and may be the prime itself.
+    uint32_t n_exact = _n_min;
+    for (; n_exact <= _n_max && std::log2((double)_k) + n_exact*std::log2((double)_b) <= 62; n_exact++);
+    auto strike = [&](uint32_t n, uint64_t p)
+    {
+        if (n < n_exact)
+        {
+            uint64_t val = _k;
+            for (uint32_t i = 0; i < n; i++)
+                val *= _b;
+            if ((int64_t)val + _c == (int64_t)p)
+                return;
+        }
+        clear(bitmap, n - _n_min);
+    };
+
+    for (const uint64_t* it = primes; it != primes + count; it++)
+    {
+        uint64_t p = *it;
+        if (p == 2 || _b%p == 0 || _k%p == 0)
+            continue;
+        uint64_t cm = _c >= 0 ? (uint64_t)_c%p : (p - (uint64_t)(-(int64_t)_c)%p)%p;
+        if (cm == 0)
+            continue;
+        Montgomery64 mont(p);
+        // b^n = -c/k (mod p)
+        uint64_t target = mont.mul(mont.to(p - cm), mont.inv(mont.to(_k)));
+        uint64_t mb = mont.to(_b);
+
+        std::fill(values.begin(), values.end(), UINT32_MAX);
+        uint64_t x = mont.one();
+        uint32_t order = 0;
+        for (uint32_t j = 0; j < m; j++)
+        {
+            if (j > 0 && x == mont.one())
+            {
+                order = j;
+                break;
+            }
+            size_t h;
+            for (h = hash(x); values[h] != UINT32_MAX; h = (h + 1) & (hash_size - 1));
+            keys[h] = x;
+            values[h] = j;
+            x = mont.mul(x, mb);
+        }
+
+        uint64_t mb_inv = mont.inv(mb);
+        uint64_t y = mont.mul(target, mont.pow(mb_inv, _n_min));
+        if (order != 0)
+        {
+            uint32_t j = lookup(y);
+            if (j != UINT32_MAX)
+                for (uint64_t n = _n_min + j; n <= _n_max; n += order)
+                    strike((uint32_t)n, p);
+        }
+        else
+        {
+            uint64_t giant = mont.inv(x);
+            for (uint64_t n = _n_min; n <= _n_max; n += m, y = mont.mul(y, giant))
+            {
+                uint32_t j = lookup(y);
+                if (j != UINT32_MAX && n + j <= _n_max)
+                    strike((uint32_t)(n + j), p);
+            }
+        }
+    }
+}
+
+void Sieve::run(uint64_t max_prime, int thread_count, File* file, Logging& logging)
+{
+    if (thread_count < 1)
+        thread_count = 1;
+    if (max_prime >= (1ULL << 62))
+        max_prime = (1ULL << 62) - 1;
+
+    std::unique_ptr<SieveState> state(read_state<SieveState>(file));
+    if (state && state->bitmap().size() == _bitmap.size() && state->prime() > _prime)
+    {
+        _prime = state->prime();
+        _bitmap = std::move(state->bitmap());
+        logging.info("restarting at p = %" PRIu64 ", %d candidates.\n", _prime, count());
+    }
+    else
+        state.reset(new SieveState());
+    if (_prime < 2)
+    {
+        sieve_small();
+        _prime = 2;
+    }
+
+    std::vector<uint64_t> primes;
+    std::vector<std::vector<uint64_t>> bitmaps(thread_count);
+    auto last_write = std::chrono::system_clock::now();
+    auto last_progress = std::chrono::system_clock::now();
+    int iteration = state->iteration();
+    while (_prime < max_prime)
+    {
+        uint64_t end = _prime + 1 + (uint64_t)(thread_count*PRIMES_PER_THREAD*std::log((double)_prime + 1000));
+        if (end > max_prime + 1 || end < _prime)
+            end = max_prime + 1;
+        PrimeIterator::get().sieve_range(_prime + 1, end, primes);
+
+        size_t chunk = (primes.size() + thread_count - 1)/thread_count;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_count; i++)
+        {
+            bitmaps[i] = _bitmap;
+            size_t first = std::min(primes.size(), i*chunk);
+            size_t last = std::min(primes.size(), first + chunk);
+            if (i > 0)
+                threads.emplace_back([this, &primes, &bitmaps, i, first, last]() { sieve(primes.data() + first, last - first, bitmaps[i]); });
+        }
+        sieve(primes.data(), std::min(primes.size(), chunk), bitmaps[0]);
+        for (auto& thread : threads)
+            thread.join();
+        for (int i = 0; i < thread_count; i++)
+            for (size_t j = 0; j < _bitmap.size(); j++)
+                _bitmap[j] &= bitmaps[i][j];
+        _prime = end - 1;
+        iteration++;
+
+        logging.progress().update(std::log((double)_prime)/std::log((double)max_prime), 0);
+        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_write).count() >= Task::DISK_WRITE_TIME || _prime >= max_prime || Task::abort_flag())
+        {
+            if (file != nullptr)
+            {
+                state->set(iteration, _prime, _bitmap);
+                file->write(*state);
+            }
+            last_write = std::chrono::system_clock::now();
+        }
+        if (Task::abort_flag())
+            throw TaskAbortException();
+        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_progress).count() >= Task::PROGRESS_TIME)
+        {
+            logging.report_progress();
+            last_progress = std::chrono::system_clock::now();
+        }
+        logging.heartbeat();
+    }
+    logging.progress().update(1, 0);
+    logging.info("sieved to p = %" PRIu64 ", %d candidates left.\n", _prime, count());
+}
+
+FactorialSieve::FactorialSieve(int type, uint32_t multifactorial, uint32_t n_min, uint32_t n_max, int c) : Sieve(n_min <= n_max ? 2*(n_max - n_min + 1) : 0), _type(type), _multifactorial(multifactorial), _n_min(n_min), _n_max(n_max), _c(c)
+{
+    if ((type != InputNum::FACTORIAL && type != InputNum::PRIMORIAL) || multifactorial < 1 || n_min > n_max || n_max >= (1U << 31) || c < -1 || c > 1)
+        throw std::invalid_argument("Invalid sieve parameters.");
+    if (type == InputNum::PRIMORIAL)
+    {
+        _multifactorial = 1;
+        std::vector<uint64_t> primes;
+        PrimeIterator::get().sieve_range(2, (uint64_t)n_max + 1, primes);
+        for (auto it = primes.begin(); it != primes.end(); it++)
+            _factors.push_back((uint32_t)*it);
+    }
+    else
+        for (uint32_t n = 2; n <= n_max; n++)
+            _factors.push_back(n);
+
+    // Exact values of the product while they fit in 64 bits, indexed by n. UINT64_MAX marks overflow.
+    std::vector<uint64_t> ring(_multifactorial, 1);
+    uint32_t small_classes = _multifactorial;
+    _small.push_back(1);
+    for (uint32_t n = 1; n <= n_max && small_classes > 0; n++)
+    {
+        uint64_t& val = ring[n%_multifactorial];
+        if (n >= 2 && val != UINT64_MAX && (_type == InputNum::FACTORIAL || std::binary_search(_factors.begin(), _factors.end(), n)))
+        {
+            if (val > (1ULL << 62)/n)
+            {
+                val = UINT64_MAX;
+                small_classes--;
+            }
+            else
+                val *= n;
+        }
+        _small.push_back(val);
+    }
+}
+
+uint32_t FactorialSieve::fingerprint()
+{
+    return File::unique_fingerprint(_multifactorial, candidate_text(_n_min, _c) + ".." + std::to_string(_n_max));
+}
+
+std::string FactorialSieve::candidate_text(uint32_t n, int c)
+{
+    std::string res = std::to_string(n);
+    if (_type == InputNum::PRIMORIAL)
+        res.append(1, '#');
+    else if (_multifactorial <= 3)
+        res.append(_multifactorial, '!');
+    else
+        res.append(1, '!').append(std::to_string(_multifactorial));
+    res.append(c < 0 ? "-1" : "+1");
+    return res;
+}
+
+void FactorialSieve::sieve_small()
+{
+    // Parity of each product class, so that even values can be struck without sieving by 2.
+    std::vector<bool> even(_multifactorial, false);
+    for (uint32_t n = 0; n <= _n_max; n++)
+    {
+        if (n >= 2 && (n & 1) == 0 && (_type == InputNum::FACTORIAL || n == 2))
+            even[n%_multifactorial] = true;
+        if (n < _n_min)
+            continue;
+        bool skip = _type == InputNum::PRIMORIAL && !std::binary_search(_factors.begin(), _factors.end(), n);
+        for (int i = 0; i < 2; i++)
+        {
+            if (skip || (i == 0 && _c > 0) || (i == 1 && _c < 0))
+                clear(_bitmap, 2*(n - _n_min) + i);
+            else if (n < _small.size() && _small[n] != UINT64_MAX)
+            {
+                uint64_t val = _small[n] + 2*i - 1;
+                if (val < 2 || ((val & 1) == 0 && val != 2))
+                    clear(_bitmap, 2*(n - _n_min) + i);
+            }
+            else if (!even[n%_multifactorial])
+                clear(_bitmap, 2*(n - _n_min) + i);
+        }
+    }
+}
+
+template<int L>
+void FactorialSieve::sieve_lanes(const uint64_t* primes, std::vector<uint64_t>& bitmap)
+{
+    // Independent lanes interleave the multiplication chains of several primes.
+    std::vector<Montgomery64> mont;
+    uint64_t one[L], minus_one[L], mn[L] = {};
+    for (int l = 0; l < L; l++)
+    {
+        mont.emplace_back(primes[l]);
+        one[l] = mont[l].one();
+        minus_one[l] = mont[l].sub(0, one[l]);
+    }
+    std::vector<uint64_t> residues(_multifactorial*L);
+    for (uint32_t i = 0; i < _multifactorial; i++)
+        for (int l = 0; l < L; l++)
+            residues[i*L + l] = one[l];
+    if (_type == InputNum::FACTORIAL)
+        for (int l = 0; l < L; l++)
+            mn[l] = mont[l].add(one[l], one[l]);
+
+    auto strike = [&](uint32_t n, int i, uint64_t p)
+    {
+        if (n < _small.size() && _small[n] + 2*i - 1 == p)
+            return;
+        clear(bitmap, 2*(n - _n_min) + i);
+    };
+
+    uint32_t cls = 2%_multifactorial;
+    for (auto it = _factors.begin(); it != _factors.end(); it++)
+    {
+        uint32_t n = *it;
+        uint64_t* r = residues.data() + (_type == InputNum::FACTORIAL ? cls*L : 0);
+        for (int l = 0; l < L; l++)
+        {
+            if (_type == InputNum::PRIMORIAL)
+                mn[l] = mont[l].to(n);
+            r[l] = mont[l].mul(r[l], mn[l]);
+            if (_type == InputNum::FACTORIAL)
+                mn[l] = mont[l].add(mn[l], one[l]);
+        }
+        if (++cls == _multifactorial)
+            cls = 0;
+        if (n < _n_min)
+            continue;
+        for (int l = 0; l < L; l++)
+        {
+            if (r[l] == one[l])
+                strike(n, 0, primes[l]);
+            if (r[l] == minus_one[l])
+                strike(n, 1, primes[l]);
+        }
+    }
+}
+
+void FactorialSieve::sieve(const uint64_t* primes, size_t count, std::vector<uint64_t>& bitmap)
+{
+    // Parity is handled by sieve_small().
+    const uint64_t* it = primes;
+    for (; it != primes + count && *it <= 2; it++);
+    for (; it + LANES <= primes + count; it += LANES)
+        sieve_lanes<LANES>(it, bitmap);
+    for (; it != primes + count; it++)
+        sieve_lanes<1>(it, bitmap);
+}
+
+int TrialFactoring::SEGMENT_SIZE = 1 << 16;
+int TrialFactoring::PRESIEVE_PRIMES = 2000;
+
+TrialFactoring::TrialFactoring(InputNum& input) : _input(input)
+{
+    if (input.type() != InputNum::KBNC || input.k() == 0 || input.b() == 0 || input.d() == 0 || input.k() >= (1ULL << 62))
+        throw std::invalid_argument("Trial factoring is not supported for this number.");
+    _k = input.k();
+    _b = input.b();
+    _n = input.n();
+    _d = input.d();
+    _c = (int64_t)input.c()*_d;
+
+    bool n_prime = _n > 2;
+    for (uint32_t i = 2; n_prime && i*i <= _n; i++)
+        if (_n%i == 0)
+            n_prime = false;
+    // Primitive factors of b^n+-1 are 1 mod 2n, the others divide b+-1.
+    _step = _k == 1 && input.d() == 1 && (_c == 1 || _c == -1) && n_prime ? 2*(uint64_t)_n : 2;
+    _mersenne = _step != 2 && _b == 2 && _c == -1;
+    if (input.bitlen() <= 62)
+    {
+        Giant value = input.value();
+        _limit = value.size() == 2 ? *(uint64_t*)value.data() : value.size() == 1 ? *value.data() : 0;
+    }
+
+    PrimeList& list = PrimeList::primes_16bit();
+    for (size_t i = 1; i < list.size() && (int)_primes.size() < PRESIEVE_PRIMES; i++)
+    {
+        uint32_t r = list[i];
+        if (_step%r == 0)
+            continue;
+        // step*j + 1 = 0 (mod r)
+        uint32_t inv = 1;
+        for (uint32_t s = (uint32_t)(_step%r), e = r - 2; e > 0; e >>= 1, s = (uint32_t)((uint64_t)s*s%r))
+            if (e & 1)
+                inv = (uint32_t)((uint64_t)inv*s%r);
+        _primes.push_back(r);
+        _roots.push_back(r - inv);
+    }
+}
+
+template<int L>
+uint64_t TrialFactoring::test_lanes(const uint64_t* q)
+{
+    // Lanes share the exponent, so the ladders run in lock-step.
+    Montgomery64 mont[L];
+    uint64_t x[L], mb[L];
+    for (int l = 0; l < L; l++)
+    {
+        mont[l] = Montgomery64(q[l]);
+        mb[l] = mont[l].to(_b%q[l]);
+        x[l] = _n != 0 ? mb[l] : mont[l].one();
+    }
+    int bit;
+    for (bit = 31; bit >= 0 && !((_n >> bit) & 1); bit--);
+    for (bit--; bit >= 0; bit--)
+    {
+        for (int l = 0; l < L; l++)
+            x[l] = mont[l].mul(x[l], x[l]);
+        if ((_n >> bit) & 1)
+            for (int l = 0; l < L; l++)
+                x[l] = mont[l].mul(x[l], mb[l]);
+    }
+    for (int l = 0; l < L; l++)
+    {
+        uint64_t cm = _c >= 0 ? (uint64_t)_c%q[l] : (q[l] - (uint64_t)(-_c)%q[l])%q[l];
+        if (mont[l].add(mont[l].mul(x[l], mont[l].to(_k%q[l])), mont[l].to(cm)) == 0 && _d%q[l] != 0)
+            return q[l];
+    }
+    return 0;
+}
+
+uint64_t TrialFactoring::test_segment(uint64_t j_start, uint64_t j_end, std::vector<char>& sieve, std::vector<uint64_t>& candidates)
+{
+    sieve.assign(j_end - j_start, 1);
+    for (size_t i = 0; i < _primes.size(); i++)
+    {
+        uint32_t r = _primes[i];
+        uint64_t j = (_roots[i] + r - j_start%r)%r;
+        if (j_start + j == 0 || _step*(j_start + j) + 1 == r)
+            j += r;
+        for (; j < j_end - j_start; j += r)
+            sieve[j] = 0;
+    }
+    candidates.clear();
+    for (uint64_t j = 0; j < j_end - j_start; j++)
+        if (sieve[j])
+        {
+            uint64_t q = _step*(j_start + j) + 1;
+            if (q < 3 || q >= _limit || (_mersenne && (q & 7) != 1 && (q & 7) != 7))
+                continue;
+            candidates.push_back(q);
+        }
+
+    size_t i;
+    uint64_t res;
+    for (i = 0; i + LANES <= candidates.size(); i += LANES)
+        if ((res = test_lanes<LANES>(candidates.data() + i)) != 0)
+            return res;
+    for (; i < candidates.size(); i++)
+        if ((res = test_lanes<1>(candidates.data() + i)) != 0)
+            return res;
+    return 0;
+}
+
+bool TrialFactoring::run(uint64_t max_factor, int thread_count, Logging& logging)
+{
+    if (thread_count < 1)
+        thread_count = 1;
+    if (max_factor >= (1ULL << 62))
+        max_factor = (1ULL << 62) - 1;
+    _factor = 0;
+    _searched = 0;
+
+    if ((_d & 1) != 0 && ((_k & 1) == 0 || (_b & 1) == 0 ? (_c & 1) == 0 : (_c & 1) != 0))
+        _factor = _limit > 2 ? 2 : 0;
+    uint64_t bc = _b + (uint64_t)_c;
+    if (_factor == 0 && _step != 2 && (int64_t)bc > 1)
+    {
+        // b+c divides b^n+c for odd n.
+        uint64_t f;
+        for (f = 2; f*f <= bc && bc%f != 0; f++);
+        if (f*f > bc)
+            f = bc;
+        if (f < _limit && f <= max_factor)
+            _factor = f;
+    }
+    uint64_t j_max = (max_factor - 1)/_step + 1;
+    std::vector<std::vector<char>> sieves(thread_count);
+    std::vector<std::vector<uint64_t>> candidates(thread_count);
+    std::vector<uint64_t> found(thread_count);
+    auto last_progress = std::chrono::system_clock::now();
+    for (uint64_t j = 0; j < j_max && _factor == 0; j += (uint64_t)thread_count*SEGMENT_SIZE)
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_count; i++)
+        {
+            uint64_t j_start = std::min(j_max, j + (uint64_t)i*SEGMENT_SIZE);
+            uint64_t j_end = std::min(j_max, j_start + SEGMENT_SIZE);
+            if (i > 0)
+                threads.emplace_back([this, &sieves, &candidates, &found, i, j_start, j_end]() { found[i] = test_segment(j_start, j_end, sieves[i], candidates[i]); });
+            else
+                found[0] = test_segment(j_start, j_end, sieves[0], candidates[0]);
+        }
+        for (auto& thread : threads)
+            thread.join();
+        for (int i = 0; i < thread_count && _factor == 0; i++)
+            _factor = found[i];
+        _searched = std::min(max_factor, _step*(j + (uint64_t)thread_count*SEGMENT_SIZE));
+
+        logging.progress().update(std::log((double)_searched)/std::log((double)max_factor), 0);
+        if (Task::abort_flag())
+            throw TaskAbortException();
+        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_progress).count() >= Task::PROGRESS_TIME)
+        {
+            logging.report_progress();
+            last_progress = std::chrono::system_clock::now();
+        }
+        logging.heartbeat();
+    }
+    logging.progress().update(1, 0);
+
+    if (_factor == 0)
+    {
+        logging.info("no factors below %" PRIu64 ".\n", max_factor);
+        return false;
+    }
+    Giant factor;
+    factor.arithmetic().init((uint32_t*)&_factor, 2, factor);
+    logging.report_factor(_input, factor);
+    return true;
+}
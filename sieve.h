@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "task.h"
+
+class SieveState : public TaskState
+{
+public:
+    static const char TYPE = 10;
+
+public:
+    SieveState() : TaskState(TYPE) { }
+    template<class T>
+    void set(int iteration, uint64_t prime, T&& bitmap) { TaskState::set(iteration); _prime = prime; _bitmap = std::forward<T>(bitmap); }
+    bool read(Reader& reader) override;
+    void write(Writer& writer) override;
+
+    uint64_t prime() { return _prime; }
+    std::vector<uint64_t>& bitmap() { return _bitmap; }
+
+private:
+    uint64_t _prime = 0;
+    std::vector<uint64_t> _bitmap;
+};
+
+// Common driver: walks primes from PrimeIterator in batches split across threads, checkpointing the bitmap of survivors.
+class Sieve
+{
+public:
+    static int PRIMES_PER_THREAD;
+
+public:
+    Sieve(uint32_t size);
+    virtual ~Sieve() { }
+
+    void run(uint64_t max_prime, int thread_count, File* file, Logging& logging);
+
+    int count();
+    void write_candidates(File& file);
+
+    uint64_t prime() { return _prime; }
+    virtual uint32_t fingerprint() = 0;
+
+protected:
+    virtual void sieve(const uint64_t* primes, size_t count, std::vector<uint64_t>& bitmap) = 0;
+    virtual void sieve_small() = 0;
+    virtual std::string text(uint32_t index) = 0;
+
+    bool bit(uint32_t index) { return ((_bitmap[index >> 6] >> (index & 63)) & 1) != 0; }
+    static void clear(std::vector<uint64_t>& bitmap, uint32_t index) { bitmap[index >> 6] &= ~(1ULL << (index & 63)); }
+
+protected:
+    uint32_t _size;
+    uint64_t _prime = 0;
+    std::vector<uint64_t> _bitmap;
+};
+
+// Sieves k*b^n+c for n_min <= n <= n_max by small primes, using BSGS discrete logs over the n range.
+class KBNCSieve : public Sieve
+{
+public:
+    KBNCSieve(uint64_t k, uint32_t b, uint32_t n_min, uint32_t n_max, int32_t c);
+
+    bool is_candidate(uint32_t n) { return n >= _n_min && n <= _n_max && bit(n - _n_min); }
+    std::vector<uint32_t> candidates();
+    std::string candidate_text(uint32_t n);
+
+    uint64_t k() { return _k; }
+    uint32_t b() { return _b; }
+    int32_t c() { return _c; }
+    uint32_t fingerprint() override;
+
+protected:
+    void sieve(const uint64_t* primes, size_t count, std::vector<uint64_t>& bitmap) override;
+    void sieve_small() override;
+    std::string text(uint32_t index) override { return candidate_text(_n_min + index); }
+
+private:
+    uint64_t _k;
+    uint32_t _b;
+    uint32_t _n_min;
+    uint32_t _n_max;
+    int32_t _c;
+};
+
+// Sieves n!k+-1 or n#+-1 for n_min <= n <= n_max, carrying the residue of the product mod p across n.
+class FactorialSieve : public Sieve
+{
+public:
+    static const int LANES = 4;
+
+public:
+    // type is InputNum::FACTORIAL or InputNum::PRIMORIAL, c is 1, -1 or 0 for both.
+    FactorialSieve(int type, uint32_t multifactorial, uint32_t n_min, uint32_t n_max, int c);
+
+    bool is_candidate(uint32_t n, int c) { return n >= _n_min && n <= _n_max && bit(2*(n - _n_min) + (c > 0 ? 1 : 0)); }
+    std::string candidate_text(uint32_t n, int c);
+
+    int type() { return _type; }
+    uint32_t multifactorial() { return _multifactorial; }
+    uint32_t fingerprint() override;
+
+protected:
+    void sieve(const uint64_t* primes, size_t count, std::vector<uint64_t>& bitmap) override;
+    void sieve_small() override;
+    std::string text(uint32_t index) override { return candidate_text(_n_min + index/2, (index & 1) ? 1 : -1); }
+
+    template<int L>
+    void sieve_lanes(const uint64_t* primes, std::vector<uint64_t>& bitmap);
+
+private:
+    int _type;
+    uint32_t _multifactorial;
+    uint32_t _n_min;
+    uint32_t _n_max;
+    int _c;
+    std::vector<uint32_t> _factors;
+    std::vector<uint64_t> _small;
+};
+
+// Trial factoring of k*b^n/d+c. Factors of b^n+-1 with prime n are searched in the form 2jn+1.
+class TrialFactoring
+{
+public:
+    static const int LANES = 4;
+    static int SEGMENT_SIZE;
+    static int PRESIEVE_PRIMES;
+
+public:
+    TrialFactoring(InputNum& input);
+
+    // Returns true if a factor below max_factor is found, the factor is reported via logging.
+    bool run(uint64_t max_factor, int thread_count, Logging& logging);
+
+    uint64_t step() { return _step; }
+    uint64_t factor() { return _factor; }
+    uint64_t searched() { return _searched; }
+
+private:
+    uint64_t test_segment(uint64_t j_start, uint64_t j_end, std::vector<char>& sieve, std::vector<uint64_t>& candidates);
+    template<int L>
+    uint64_t test_lanes(const uint64_t* q);
+
+private:
+    InputNum& _input;
+    uint64_t _k;
+    uint32_t _b;
+    uint32_t _n;
+    uint32_t _d;
+    int64_t _c;
+    uint64_t _step;
+    bool _mersenne = false;
+    uint64_t _limit = UINT64_MAX;
+    std::vector<uint32_t> _primes;
+    std::vector<uint32_t> _roots;
+    uint64_t _factor = 0;
+    uint64_t _searched = 0;
+};
@@ -0,0 +1,1322 @@
+
+#include <cmath>
+#include <cinttypes>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include "gwnum.h"
+#include "cpuid.h"
+#include "stage2.h"
+#include "integer.h"
+
+using namespace arithmetic;
+
+int MontgomeryStage2::GIANT_BATCH = 256;
+int Stage2Plan::PRIMES_PER_BATCH = 1 << 20;
+int Stage2Plan::MAX_MULTIPLIER = 127;
+double DeferredGCD::RATIO = 100;
+double DeferredGCD::GCD_MULS = 50;
+bool DeferredGCD::EVERY_CHECKPOINT = false;
+
+namespace
+{
+    uint32_t gcd32(uint32_t a, uint32_t b)
+    {
+        while (b != 0)
+        {
+            uint32_t t = a%b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    uint32_t euler_phi(uint32_t D, uint32_t& max_factor)
+    {
+        uint32_t res = D;
+        max_factor = 1;
+        for (uint32_t p = 2; p*p <= D; p++)
+            if (D%p == 0)
+            {
+                res = res/p*(p - 1);
+                max_factor = p;
+                while (D%p == 0)
+                    D /= p;
+            }
+        if (D > 1)
+        {
+            res = res/D*(D - 1);
+            max_factor = D;
+        }
+        return res;
+    }
+
+    // res1 = m*a, res2 = (m + 1)*a.
+    template<class Element>
+    void ladder(DifferentialGroupArithmetic<Element>& arithmetic, Element& a, uint64_t m, Element& res1, Element& res2)
+    {
+        if (m == 0)
+        {
+            arithmetic.init(res1);
+            res2 = a;
+            return;
+        }
+        Element diff(a);
+        arithmetic.optimize(diff);
+        int len;
+        for (len = 1; len < 64 && m >= (1ULL << len); len++);
+        res1 = a;
+        arithmetic.dbl(a, res2);
+        for (len -= 2; len >= 0; len--)
+            if ((m >> len) & 1)
+            {
+                arithmetic.add(res2, res1, diff, res1);
+                arithmetic.dbl(res2, res2);
+            }
+            else
+            {
+                arithmetic.add(res2, res1, diff, res2);
+                arithmetic.dbl(res1, res1);
+            }
+    }
+
+    // X - V as a monic polynomial of degree 1.
+    Poly* root_poly(PolyMult& pm, const GWNum& value)
+    {
+        GWNum c(pm.gw());
+        c = value;
+        pm.gw().unfft(c, c);
+        pm.gw().neg(c, c);
+        Poly* res = new Poly(pm);
+        pm.init(std::move(c), true, *res);
+        return res;
+    }
+
+    void identity(EdwardsArithmetic& ed, EdPoint& res)
+    {
+        GWNum zero(ed.gw());
+        zero = 0;
+        GWNum one(ed.gw());
+        one = 1;
+        ed.init(zero, one, res);
+    }
+
+    void identity(LucasUVArithmetic& lucas, LucasUV& res)
+    {
+        lucas.init(res);
+    }
+
+    void extend(EdPoint& a)
+    {
+        a.extend();
+    }
+
+    void extend(LucasUV&)
+    {
+    }
+
+    // table[j] = (delta^j f)(x)*P for the step of the differences, diffs[j] = (delta^j f)(x).
+    template<class Arithmetic, class Element>
+    void differences_init(Arithmetic& arithmetic, Element& P, const BrentSuyama& bs, uint64_t x, uint64_t step, std::vector<Giant>& diffs, std::vector<std::unique_ptr<Element>>& table)
+    {
+        bs.differences(x, step, diffs);
+        table.clear();
+        for (auto& k : diffs)
+        {
+            table.emplace_back(new Element(arithmetic));
+            if (k == 0)
+                identity(arithmetic, *table.back());
+            else
+                arithmetic.mul(P, k, *table.back());
+            extend(*table.back());
+        }
+    }
+
+    // Moves table[0] from f(x)*P to f(x + step)*P.
+    // Edwards addition is not unified, equal multiples are doubled instead.
+    template<class Arithmetic, class Element>
+    void differences_next(Arithmetic& arithmetic, std::vector<Giant>& diffs, std::vector<std::unique_ptr<Element>>& table)
+    {
+        for (size_t j = 0; j + 1 < table.size(); j++)
+        {
+            if (diffs[j] == diffs[j + 1])
+            {
+                arithmetic.dbl(*table[j], *table[j]);
+                extend(*table[j]);
+            }
+            else
+                arithmetic.add(*table[j], *table[j + 1], *table[j]);
+            diffs[j] += diffs[j + 1];
+        }
+    }
+
+    // Integral of f(t)/t over [a, b] by the trapezoid rule.
+    template<class F>
+    double integrate(F f, double a, double b)
+    {
+        const int STEPS = 256;
+        if (b <= a)
+            return 0;
+        double h = (b - a)/STEPS;
+        double res = (f(a)/a + f(b)/b)/2;
+        for (int i = 1; i < STEPS; i++)
+            res += f(a + i*h)/(a + i*h);
+        return res*h;
+    }
+}
+
+Stage2Plan::Stage2Plan(uint64_t B1, uint64_t B2, int max_memory, double cost_baby, double cost_giant, double cost_pair) : TaskState(TYPE)
+{
+    init(B1, B2, choose_D(B1, B2, max_memory, cost_baby, cost_giant, cost_pair));
+}
+
+Stage2Plan::Stage2Plan(uint64_t B1, uint64_t B2, uint32_t D) : TaskState(TYPE)
+{
+    init(B1, B2, D);
+}
+
+int Stage2Plan::baby_steps(uint32_t D)
+{
+    uint32_t max_factor;
+    return euler_phi(D, max_factor)/2;
+}
+
+double Stage2Plan::estimate_cost(uint64_t B1, uint64_t B2, uint32_t D, double cost_baby, double cost_giant, double cost_pair)
+{
+    uint32_t max_factor;
+    double log_mid = std::log((B1/2.0 + B2/2.0) + 3);
+    double primes = (B2 - B1)/log_mid;
+    // Probability that the other number of a slot is prime too.
+    double partner = std::min(1.0, D/(double)euler_phi(D, max_factor)/log_mid);
+    return cost_baby*D/4 + cost_giant*((B2 - B1)/(double)D + 1) + cost_pair*primes*(1 - partner/2);
+}
+
+uint32_t Stage2Plan::choose_D(uint64_t B1, uint64_t B2, int max_memory, double cost_baby, double cost_giant, double cost_pair)
+{
+    std::vector<uint32_t> candidates;
+    candidates.push_back(6);
+    for (uint32_t k = 1; k < 7; k++)
+        candidates.push_back(30*k);
+    for (uint32_t k = 1; k < 11; k++)
+        candidates.push_back(210*k);
+    for (uint32_t k = 1; k < 100000 && 2310*k/4 < B2 - B1 + 2310; k++)
+        candidates.push_back(2310*k);
+
+    uint32_t best = 0;
+    double best_cost = 0;
+    for (uint32_t D : candidates)
+    {
+        uint32_t max_factor;
+        uint32_t phi = euler_phi(D, max_factor);
+        if ((int)(phi/2) > max_memory)
+            break;
+        if (best != 0 && cost_baby*D/4 > best_cost)
+            break;
+        if (max_factor > B1)
+            continue;
+        double cost = estimate_cost(B1, B2, D, cost_baby, cost_giant, cost_pair);
+        if (best == 0 || cost < best_cost)
+        {
+            best = D;
+            best_cost = cost;
+        }
+    }
+    if (best == 0)
+        throw std::invalid_argument("Stage 2 does not fit in memory.");
+    return best;
+}
+
+void Stage2Plan::init(uint64_t B1, uint64_t B2, uint32_t D)
+{
+    uint32_t max_factor;
+    if (D < 6 || D%6 != 0 || D > (1U << 30) || B2 <= B1 || B2 >= (1ULL << 62) || euler_phi(D, max_factor) == 0 || max_factor > B1)
+        throw std::invalid_argument("Invalid stage 2 parameters.");
+    _B1 = B1;
+    _B2 = B2;
+    _D = D;
+    _residues.clear();
+    _index.resize(D/2);
+    for (uint32_t r = 0; r < D/2; r++)
+    {
+        _index[r] = -1;
+        if (gcd32(r, D) == 1)
+        {
+            _index[r] = (int)_residues.size();
+            _residues.push_back(r);
+        }
+    }
+    _m_first = (B1 + 1 + D/2)/D;
+    _m_last = (B2 + D/2)/D;
+    _words = (int)(_residues.size() + 63)/64;
+    _bitmap.clear();
+    _primes = 0;
+    _pairs = 0;
+    _paired = 0;
+    _multiples = 0;
+}
+
+void Stage2Plan::build()
+{
+    _bitmap.assign(giant_steps()*_words, 0);
+    _primes = 0;
+    _pairs = 0;
+    _paired = 0;
+    _multiples = 0;
+
+    std::vector<uint64_t> primes;
+    for (uint64_t start = _B1 + 1; start <= _B2; )
+    {
+        uint64_t end = start + (uint64_t)(PRIMES_PER_BATCH*std::log((double)start + 1000));
+        if (end > _B2 + 1)
+            end = _B2 + 1;
+        PrimeIterator::get().sieve_range(start, end, primes);
+        for (uint64_t p : primes)
+        {
+            uint64_t m = (p + _D/2)/_D;
+            int index = _index[p > m*_D ? p - m*_D : m*_D - p];
+            if (pair(m, index))
+                _paired++;
+            else
+            {
+                set_pair(m, index);
+                _pairs++;
+            }
+            _primes++;
+        }
+        start = end;
+    }
+
+    cover_multiples();
+}
+
+// A prime p not sharing its slot is also covered by the slot of any multiple c*p, gcd(c, D) = 1.
+// Slots are released in descending order of p, so the slot of c*p > p + D is already final.
+void Stage2Plan::cover_multiples()
+{
+    uint64_t max_value = _m_last*_D + _D/2 - 1;
+    uint32_t c_min = 2;
+    while (gcd32(c_min, _D) != 1)
+        c_min++;
+    if (MAX_MULTIPLIER < (int)c_min)
+        return;
+    uint64_t first = std::max(_B1, (uint64_t)_D) + 1;
+    uint64_t last = std::min(_B2, max_value/c_min);
+
+    std::vector<uint64_t> primes;
+    for (uint64_t end = last + 1; end > first; )
+    {
+        uint64_t start = (uint64_t)(PRIMES_PER_BATCH*std::log((double)end + 1000));
+        start = end - first > start ? end - start : first;
+        // Partners lie within D/2 of their slot.
+        PrimeIterator::get().sieve_range(start > _D ? start - _D : 2, end + _D, primes);
+        for (auto it = primes.rbegin(); it != primes.rend(); it++)
+        {
+            uint64_t p = *it;
+            if (p < start || p >= end)
+                continue;
+            uint64_t m = (p + _D/2)/_D;
+            uint64_t q = 2*m*_D - p;
+            if (q > _B1 && q <= _B2 && std::binary_search(primes.begin(), primes.end(), q))
+                continue;
+            int index = _index[p > m*_D ? p - m*_D : m*_D - p];
+            for (uint32_t c = c_min; c <= (uint32_t)MAX_MULTIPLIER; c++)
+            {
+                uint64_t v = c*p;
+                if (v > max_value)
+                    break;
+                if (gcd32(c, _D) != 1)
+                    continue;
+                uint64_t mv = (v + _D/2)/_D;
+                if (pair(mv, _index[v > mv*_D ? v - mv*_D : mv*_D - v]))
+                {
+                    clear_pair(m, index);
+                    _pairs--;
+                    _multiples++;
+                    break;
+                }
+            }
+        }
+        end = start;
+    }
+}
+
+bool Stage2Plan::empty(uint64_t m) const
+{
+    const uint64_t* row = giant(m);
+    for (int j = 0; j < _words; j++)
+        if (row[j] != 0)
+            return false;
+    return true;
+}
+
+void BrentSuyama::eval(uint64_t x, Giant& res) const
+{
+    Giant gx;
+    gx.arithmetic().init((uint32_t*)&x, 2, gx);
+    if (!_dickson)
+    {
+        res = gx;
+        for (int i = 1; i < _degree; i++)
+            res *= gx;
+        return;
+    }
+    // D_0 = 2, D_1 = x, D_n = x*D_(n-1) + D_(n-2) for a = -1.
+    Giant prev;
+    prev = 2;
+    res = gx;
+    for (int i = 1; i < _degree; i++)
+    {
+        Giant next(res);
+        next *= gx;
+        next += prev;
+        prev = std::move(res);
+        res = std::move(next);
+    }
+}
+
+void BrentSuyama::differences(uint64_t x, uint64_t step, std::vector<Giant>& res) const
+{
+    res.resize(_degree + 1);
+    for (int i = 0; i <= _degree; i++)
+        eval(x + i*step, res[i]);
+    for (int j = 1; j <= _degree; j++)
+        for (int i = _degree; i >= j; i--)
+            res[i] -= res[i - 1];
+}
+
+int BrentSuyama::extra_factors() const
+{
+    int res = 0;
+    for (int d = 3; d <= 2*_degree; d++)
+        if ((2*_degree)%d == 0)
+            res++;
+    return res;
+}
+
+double BrentSuyama::dickman_rho(double u)
+{
+    static const int STEPS = 256;
+    static const int MAX_U = 20;
+    static const std::vector<double> table = []()
+    {
+        std::vector<double> rho(MAX_U*STEPS + 1);
+        for (int i = 0; i <= 2*STEPS; i++)
+            rho[i] = i <= STEPS ? 1.0 : 1.0 - std::log(i/(double)STEPS);
+        // u*rho'(u) = -rho(u - 1).
+        for (int i = 2*STEPS + 1; i <= MAX_U*STEPS; i++)
+            rho[i] = rho[i - 1] - (rho[i - 1 - STEPS]/(i - 1) + rho[i - STEPS]/i)/2;
+        return rho;
+    }();
+    if (u <= 1)
+        return 1.0;
+    if (u >= MAX_U)
+        return 0.0;
+    int i = (int)(u*STEPS);
+    double frac = u*STEPS - i;
+    return table[i]*(1 - frac) + table[i + 1]*frac;
+}
+
+double BrentSuyama::probability(const Stage2Plan& plan, double factor_bits, double torsion)
+{
+    // The largest prime q of the order lies in (B1, B2], the rest is B1-smooth. dq/(q*ln(q)) = d(ln(q))/ln(q).
+    double ln_n = factor_bits*std::log(2.0) - std::log(torsion);
+    double ln_B1 = std::log((double)plan.B1());
+    return integrate([&](double t) { return dickman_rho((ln_n - t)/ln_B1); }, ln_B1, std::min(ln_n, std::log((double)plan.B2())));
+}
+
+double BrentSuyama::extra_probability(const Stage2Plan& plan, double factor_bits, double torsion) const
+{
+    if (!enabled())
+        return 0.0;
+    // q > B2 divides one of the extra factors of a pair with probability about 1/q.
+    double ln_n = factor_bits*std::log(2.0) - std::log(torsion);
+    double ln_B1 = std::log((double)plan.B1());
+    double hits = (double)extra_factors()*plan.pairs();
+    return integrate([&](double t) { return dickman_rho((ln_n - t)/ln_B1)*(1 - std::exp(-hits*std::exp(-t))); }, std::log((double)plan.B2()), ln_n);
+}
+
+uint32_t Stage2Plan::fingerprint() const
+{
+    return File::unique_fingerprint(_D, std::to_string(_B1) + "-" + std::to_string(_B2));
+}
+
+bool Stage2Plan::read(Reader& reader)
+{
+    if (!TaskState::read(reader))
+        return false;
+    uint64_t B1, B2;
+    uint32_t D;
+    uint32_t size;
+    if (!reader.read(B1) || !reader.read(B2) || !reader.read(D))
+        return false;
+    try
+    {
+        init(B1, B2, D);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    if (!reader.read(_primes) || !reader.read(_pairs) || !reader.read(_paired) || !reader.read(_multiples) || !reader.read(size))
+        return false;
+    if (size != giant_steps()*_words)
+        return false;
+    _bitmap.resize(size);
+    for (auto it = _bitmap.begin(); it != _bitmap.end(); it++)
+        if (!reader.read(*it))
+            return false;
+    return true;
+}
+
+void Stage2Plan::write(Writer& writer)
+{
+    TaskState::write(writer);
+    writer.write(_B1);
+    writer.write(_B2);
+    writer.write(_D);
+    writer.write(_primes);
+    writer.write(_pairs);
+    writer.write(_paired);
+    writer.write(_multiples);
+    writer.write((uint32_t)_bitmap.size());
+    writer.write((const char*)_bitmap.data(), _bitmap.size()*sizeof(uint64_t));
+}
+
+bool Stage2State::read(Reader& reader)
+{
+    if (!TaskState::read(reader))
+        return false;
+    uint32_t count;
+    if (!reader.read(_fingerprint) || !reader.read(count))
+        return false;
+    _segments.resize(count);
+    for (auto& segment : _segments)
+        if (!reader.read(segment.start) || !reader.read(segment.end) || !reader.read(segment.position) || !reader.read(segment.accumulator))
+            return false;
+    return true;
+}
+
+void Stage2State::write(Writer& writer)
+{
+    TaskState::write(writer);
+    writer.write(_fingerprint);
+    writer.write((uint32_t)_segments.size());
+    for (auto& segment : _segments)
+    {
+        writer.write(segment.start);
+        writer.write(segment.end);
+        writer.write(segment.position);
+        writer.write(segment.accumulator);
+    }
+}
+
+DeferredGCD::DeferredGCD(Giant& N, bool every_checkpoint, double ratio) : _N(N), _every_checkpoint(every_checkpoint), _ratio(ratio)
+{
+    _start = std::chrono::steady_clock::now();
+    _last = _start;
+}
+
+bool DeferredGCD::due(double ops, bool checkpoint)
+{
+    if (_every_checkpoint && checkpoint)
+        return true;
+    auto now = std::chrono::steady_clock::now();
+    double gcd_time = _gcd_time;
+    if (gcd_time < 0)
+    {
+        if (ops <= 0)
+            return false;
+        gcd_time = std::chrono::duration<double>(now - _start).count()/ops*GCD_MULS*std::log2((double)_N.bitlen());
+    }
+    return std::chrono::duration<double>(now - _last).count() >= _ratio*gcd_time;
+}
+
+bool DeferredGCD::check(Giant& value)
+{
+    auto start = std::chrono::steady_clock::now();
+    _factor = value;
+    _factor.gcd(_N);
+    _last = std::chrono::steady_clock::now();
+    _gcd_time = std::chrono::duration<double>(_last - start).count();
+    _checks++;
+    return _factor != 1 && _factor != 0 && _factor != _N;
+}
+
+Stage2Segments::Worker::Worker(GWArithmetic& gw, bool clone) : _gw(gw)
+{
+    if (clone)
+    {
+        _state.reset(new GWState(gw.state()));
+        _state->thread_count = 1;
+        _gw_clone.reset(new GWArithmetic(*_state));
+    }
+    _accumulator.reset(new GWNum(this->gw()));
+}
+
+Stage2Segments::Segment* Stage2Segments::acquire(int worker, uint64_t batch)
+{
+    for (auto& segment : _segments)
+        if (segment.owner < 0 && segment.claimed < segment.end)
+        {
+            segment.owner = worker;
+            return &segment;
+        }
+
+    // Steal the upper half of the largest unclaimed range, the owner keeps at least one batch.
+    Segment* victim = nullptr;
+    for (auto& segment : _segments)
+        if (segment.owner >= 0 && segment.end - segment.claimed >= 2*batch && (victim == nullptr || segment.end - segment.claimed > victim->end - victim->claimed))
+            victim = &segment;
+    if (victim == nullptr)
+        return nullptr;
+    uint64_t middle = victim->claimed + (victim->end - victim->claimed)/2;
+    Giant one;
+    one = 1;
+    _segments.push_back(Segment{middle, victim->end, middle, middle, worker, std::move(one)});
+    victim->end = middle;
+    return &_segments.back();
+}
+
+void Stage2Segments::work(Worker& worker, int index, uint64_t batch)
+{
+    try
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        Segment* segment;
+        while (!stopped() && (segment = acquire(index, batch)) != nullptr)
+        {
+            uint64_t position = segment->position;
+            worker.accumulator() = segment->accumulator;
+            lock.unlock();
+            worker.start(position);
+            lock.lock();
+            while (!stopped() && position < segment->end)
+            {
+                uint64_t count = std::min(batch, segment->end - position);
+                segment->claimed = position + count;
+                lock.unlock();
+                worker.step(position, count, worker.accumulator());
+                Giant accumulator;
+                accumulator = worker.accumulator();
+                position += count;
+                lock.lock();
+                segment->position = position;
+                segment->accumulator = std::move(accumulator);
+                _done += count;
+                _ops[index] = worker.gw().state().ops();
+                _cond.notify_all();
+            }
+            segment->owner = -1;
+        }
+        _active--;
+        _cond.notify_all();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_error)
+            _error = std::current_exception();
+        _stop = true;
+        _active--;
+        _cond.notify_all();
+    }
+}
+
+bool Stage2Segments::stopped()
+{
+    if (Task::abort_flag())
+        _stop = true;
+    return _stop || _found;
+}
+
+void Stage2Segments::save(Stage2State& state)
+{
+    std::vector<Stage2State::Segment> segments;
+    for (auto& segment : _segments)
+        segments.push_back(Stage2State::Segment{segment.start, segment.end, segment.position, segment.accumulator});
+    state.set((int)_done, _plan.fingerprint(), segments);
+}
+
+void Stage2Segments::run(std::vector<std::unique_ptr<Worker>>& workers, uint64_t batch, GWNum& res, File* file, Logging& logging)
+{
+    GWArithmetic& gw = res.arithmetic();
+    uint64_t giant_steps = _plan.giant_steps();
+    int count = (int)workers.size();
+    _segments.clear();
+    _done = 0;
+    _stop = false;
+    _found = false;
+    _error = nullptr;
+
+    std::unique_ptr<Stage2State> state(read_state<Stage2State>(file));
+    bool valid = state && state->fingerprint() == _plan.fingerprint() && !state->segments().empty();
+    if (valid)
+    {
+        // The segments must tile [0, giant_steps) exactly.
+        std::sort(state->segments().begin(), state->segments().end(), [](const Stage2State::Segment& a, const Stage2State::Segment& b) { return a.start < b.start; });
+        uint64_t next = 0;
+        for (auto& segment : state->segments())
+        {
+            valid = valid && segment.start == next && segment.start < segment.end && segment.start <= segment.position && segment.position <= segment.end;
+            next = segment.end;
+        }
+        valid = valid && next == giant_steps;
+    }
+    if (valid)
+    {
+        for (auto& segment : state->segments())
+        {
+            _segments.push_back(Segment{segment.start, segment.end, segment.position, segment.position, -1, segment.accumulator});
+            _done += segment.position - segment.start;
+        }
+        logging.info("restarting stage 2 at %.1f%%.\n", 100.0*_done/giant_steps);
+    }
+    else
+    {
+        state.reset(new Stage2State());
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t start = giant_steps*i/count;
+            uint64_t end = giant_steps*(i + 1)/count;
+            Giant one;
+            one = 1;
+            if (start < end)
+                _segments.push_back(Segment{start, end, start, start, -1, std::move(one)});
+        }
+    }
+
+    std::vector<double> ops_base;
+    for (auto& worker : workers)
+        ops_base.push_back(worker->gw().state().ops());
+    _ops = ops_base;
+    auto ops = [&]()
+    {
+        double res = 0;
+        for (int i = 0; i < count; i++)
+            res += _ops[i] - ops_base[i];
+        return (int)res;
+    };
+
+    std::vector<std::thread> threads;
+    _active = count;
+    for (int i = 0; i < count; i++)
+        threads.emplace_back(&Stage2Segments::work, this, std::ref(*workers[i]), i, batch);
+
+    DeferredGCD deferred(*gw.state().N);
+    auto last_write = std::chrono::system_clock::now();
+    auto last_progress = std::chrono::system_clock::now();
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_active > 0)
+    {
+        _cond.wait_for(lock, std::chrono::seconds(1));
+        stopped();
+        logging.progress().update(giant_steps > 0 ? _done/(double)giant_steps : 1, ops());
+        bool checkpoint = file != nullptr && !_stop && std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_write).count() >= Task::DISK_WRITE_TIME;
+        if (checkpoint)
+        {
+            save(*state);
+            lock.unlock();
+            file->write(*state);
+            lock.lock();
+            last_write = std::chrono::system_clock::now();
+        }
+        if (!_stop && !_found && _active > 0 && deferred.due(ops()/(double)count, checkpoint))
+        {
+            // The gcd runs on the accumulators of the last completed batches while the workers go on.
+            save(*state);
+            lock.unlock();
+            Giant product;
+            product = 1;
+            for (auto& segment : state->segments())
+            {
+                product *= segment.accumulator;
+                product %= *gw.state().N;
+            }
+            bool found = deferred.check(product);
+            lock.lock();
+            if (found)
+            {
+                _found = true;
+                logging.info("factor found by gcd at %.1f%%, stopping stage 2.\n", giant_steps > 0 ? 100.0*_done/giant_steps : 100.0);
+            }
+        }
+        if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - last_progress).count() >= Task::PROGRESS_TIME)
+        {
+            logging.report_progress();
+            last_progress = std::chrono::system_clock::now();
+        }
+        logging.heartbeat();
+    }
+    lock.unlock();
+    for (auto& thread : threads)
+        thread.join();
+    if (_error)
+        std::rethrow_exception(_error);
+
+    if (file != nullptr)
+    {
+        save(*state);
+        file->write(*state);
+    }
+    if (_stop)
+        throw TaskAbortException();
+
+    res = 1;
+    GWNum tmp(gw);
+    for (auto& segment : _segments)
+    {
+        tmp = segment.accumulator;
+        gw.mul(res, tmp, res, 0);
+    }
+    logging.progress().update(1, ops());
+}
+
+void PointTableState::set(uint32_t id, std::vector<std::unique_ptr<EdY>>& points)
+{
+    for (auto& point : points)
+        if (point && point->Z)
+            throw std::invalid_argument("Points must be normalized.");
+    TaskState::set((int)points.size());
+    _id = id;
+    _coordinates = 1;
+    _ed_y = &points;
+    _ed = nullptr;
+    _values.clear();
+}
+
+void PointTableState::set(uint32_t id, std::vector<std::unique_ptr<EdPoint>>& points)
+{
+    for (auto& point : points)
+        if (point && point->Z)
+            throw std::invalid_argument("Points must be normalized.");
+    TaskState::set((int)points.size());
+    _id = id;
+    _coordinates = 2;
+    _ed_y = nullptr;
+    _ed = &points;
+    _values.clear();
+}
+
+bool PointTableState::read(Reader& reader)
+{
+    if (!TaskState::read(reader))
+        return false;
+    uint32_t count;
+    if (!reader.read(_id) || !reader.read(_coordinates) || !reader.read(count) || (_coordinates != 1 && _coordinates != 2))
+        return false;
+    _ed_y = nullptr;
+    _ed = nullptr;
+    _values.clear();
+    _values.resize((size_t)count*_coordinates);
+    for (auto& value : _values)
+        if (!reader.read(value))
+            return false;
+    return true;
+}
+
+void PointTableState::write(Writer& writer)
+{
+    TaskState::write(writer);
+    writer.write(_id);
+    writer.write(_coordinates);
+    SerializedGWNum empty;
+    SerializedGWNum value;
+    if (_ed_y != nullptr)
+    {
+        writer.write((uint32_t)_ed_y->size());
+        for (auto& point : *_ed_y)
+        {
+            if (point && point->Y)
+                value = *point->Y;
+            writer.write(point && point->Y ? value : empty);
+        }
+    }
+    else if (_ed != nullptr)
+    {
+        writer.write((uint32_t)_ed->size());
+        for (auto& point : *_ed)
+        {
+            if (point)
+                value = *point->X;
+            writer.write(point ? value : empty);
+            if (point)
+                value = *point->Y;
+            writer.write(point ? value : empty);
+        }
+    }
+    else
+    {
+        writer.write((uint32_t)size());
+        for (auto& value : _values)
+            writer.write(value);
+    }
+}
+
+bool PointTableState::get(uint32_t id, MontgomeryArithmetic& montgomery, std::vector<std::unique_ptr<EdY>>& points)
+{
+    if (_id != id || _coordinates != 1 || _ed_y != nullptr || _ed != nullptr)
+        return false;
+    points.clear();
+    points.reserve(_values.size());
+    for (auto& value : _values)
+    {
+        points.emplace_back();
+        if (value.empty())
+            continue;
+        points.back().reset(new EdY(montgomery));
+        points.back()->Y.reset(new GWNum(montgomery.gw()));
+        value.to_GWNum(*points.back()->Y);
+    }
+    _values.clear();
+    return true;
+}
+
+bool PointTableState::get(uint32_t id, EdwardsArithmetic& ed, std::vector<std::unique_ptr<EdPoint>>& points)
+{
+    if (_id != id || _coordinates != 2 || _ed_y != nullptr || _ed != nullptr)
+        return false;
+    points.clear();
+    points.reserve(_values.size()/2);
+    for (size_t i = 0; i < _values.size(); i += 2)
+    {
+        points.emplace_back();
+        if (_values[i].empty())
+            continue;
+        // Same form as EdwardsArithmetic::normalize, T = X*Y.
+        EdPoint* point = new EdPoint(ed);
+        points.back().reset(point);
+        point->X.reset(new GWNum(ed.gw()));
+        point->Y.reset(new GWNum(ed.gw()));
+        point->Z.reset();
+        point->T.reset(new GWNum(ed.gw()));
+        _values[i].to_GWNum(*point->X);
+        _values[i + 1].to_GWNum(*point->Y);
+        ed.gw().mul(*point->X, *point->Y, *point->T, 0);
+    }
+    _values.clear();
+    return true;
+}
+
+void MontgomeryStage2::baby_steps(MontgomeryArithmetic& montgomery, EdY& P, std::vector<std::unique_ptr<EdY>>& babies)
+{
+    const std::vector<uint32_t>& residues = _plan.residues();
+    babies.clear();
+    babies.reserve(residues.size());
+
+    // Odd multiples r*P by differential additions of 2P.
+    EdY prev(P);
+    EdY P2(montgomery);
+    montgomery.dbl(prev, P2);
+    EdY cur(montgomery);
+    montgomery.add(P2, prev, prev, cur);
+    babies.emplace_back(new EdY(prev));
+    for (uint32_t r = 3; babies.size() < residues.size(); r += 2)
+    {
+        if (residues[babies.size()] == r)
+            babies.emplace_back(new EdY(cur));
+        if (babies.size() == residues.size())
+            break;
+        EdY next(montgomery);
+        montgomery.add(cur, P2, prev, next);
+        prev = std::move(cur);
+        cur = std::move(next);
+    }
+
+    montgomery.normalize(babies.begin(), babies.end());
+}
+
+void MontgomeryStage2::baby_steps(MontgomeryArithmetic& montgomery, EdPoint& P, std::vector<std::unique_ptr<EdY>>& babies)
+{
+    const std::vector<uint32_t>& residues = _plan.residues();
+    babies.clear();
+    babies.reserve(residues.size());
+
+    // f(r)*P for odd r by finite differences with step 2.
+    std::vector<Giant> diffs;
+    std::vector<std::unique_ptr<EdPoint>> table;
+    differences_init(P.arithmetic(), P, _bs, 1, 2, diffs, table);
+    for (uint32_t r = 1; babies.size() < residues.size(); r += 2)
+    {
+        if (residues[babies.size()] == r)
+            babies.emplace_back(new EdY(montgomery, *table[0]));
+        if (babies.size() < residues.size())
+            differences_next(P.arithmetic(), diffs, table);
+    }
+
+    montgomery.normalize(babies.begin(), babies.end());
+}
+
+class MontgomeryStage2::Worker : public Stage2Segments::Worker
+{
+public:
+    // Giant steps are m*D*P walked by differential additions of DP, or f(m*D)*point walked by finite differences.
+    Worker(MontgomeryArithmetic& montgomery, EdY* DP, EdPoint* point, std::vector<std::unique_ptr<EdY>>& babies, const Stage2Plan& plan, const BrentSuyama& bs, bool clone)
+        : Stage2Segments::Worker(montgomery.gw(), clone), _plan(plan), _bs(bs), _babies(babies), _ed_d(gw()), _montgomery(gw(), _ed_d, montgomery.d_num(), montgomery.d_den()), _DP(_montgomery), _cur(_montgomery), _next(_montgomery), _ed(gw()), _P(_ed)
+    {
+        _ed_d = montgomery.ed_d();
+        Giant X, Y, Z, T;
+        if (DP != nullptr)
+        {
+            DP->serialize(Y, Z);
+            _DP.deserialize(Y, Z);
+        }
+        if (point != nullptr)
+        {
+            point->serialize(X, Y, Z, T);
+            _P.deserialize(X, Y, Z, T);
+        }
+    }
+
+    void start(uint64_t position) override
+    {
+        if (_bs.enabled())
+            differences_init(_ed, _P, _bs, (_plan.m_first() + position)*_plan.D(), _plan.D(), _diffs, _table);
+        else
+            ladder(_montgomery, _DP, _plan.m_first() + position, _cur, _next);
+    }
+
+    void step(uint64_t position, uint64_t count, GWNum& accumulator) override
+    {
+        uint64_t m_batch = _plan.m_first() + position;
+        std::deque<std::unique_ptr<EdY>> batch;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t m = m_batch + i;
+            if (_bs.enabled())
+                batch.emplace_back(_plan.empty(m) ? nullptr : new EdY(_montgomery, *_table[0]));
+            else
+                batch.emplace_back(_plan.empty(m) ? nullptr : new EdY(_cur));
+            if (position + i + 1 == _plan.giant_steps())
+                break;
+            if (_bs.enabled())
+            {
+                differences_next(_ed, _diffs, _table);
+                continue;
+            }
+            EdY tmp(_montgomery);
+            if (m == 0)
+                _montgomery.dbl(_next, tmp);
+            else
+                _montgomery.add(_next, _DP, _cur, tmp);
+            _cur = std::move(_next);
+            _next = std::move(tmp);
+        }
+        _montgomery.normalize(batch.begin(), batch.end());
+
+        // Baby steps are shared between workers, they are in FFT form and only read.
+        for (size_t i = 0; i < batch.size(); i++)
+            if (batch[i])
+            {
+                gw().fft(*batch[i]->Y, *batch[i]->Y);
+                for (int j = 0; j < (int)_babies.size(); j++)
+                    if (_plan.pair(m_batch + i, j))
+                        gw().submul(*batch[i]->Y, *_babies[j]->Y, accumulator, accumulator, GWMUL_STARTNEXTFFT);
+            }
+    }
+
+private:
+    const Stage2Plan& _plan;
+    const BrentSuyama& _bs;
+    std::vector<std::unique_ptr<EdY>>& _babies;
+    GWNum _ed_d;
+    MontgomeryArithmetic _montgomery;
+    EdY _DP;
+    EdY _cur;
+    EdY _next;
+    EdwardsArithmetic _ed;
+    EdPoint _P;
+    std::vector<Giant> _diffs;
+    std::vector<std::unique_ptr<EdPoint>> _table;
+};
+
+void MontgomeryStage2::run(MontgomeryArithmetic& montgomery, EdY& P, GWNum& res, int thread_count, File* file, Logging& logging)
+{
+    if (_bs.enabled())
+        throw std::invalid_argument("Brent-Suyama extension needs the full point.");
+    run_workers(montgomery, P, nullptr, res, thread_count, file, logging);
+}
+
+void MontgomeryStage2::run(MontgomeryArithmetic& montgomery, EdPoint& P, GWNum& res, int thread_count, File* file, Logging& logging)
+{
+    EdY Y(montgomery, P);
+    run_workers(montgomery, Y, _bs.enabled() ? &P : nullptr, res, thread_count, file, logging);
+}
+
+void MontgomeryStage2::run_workers(MontgomeryArithmetic& montgomery, EdY& P, EdPoint* point, GWNum& res, int thread_count, File* file, Logging& logging)
+{
+    if (thread_count < 1)
+        thread_count = 1;
+
+    std::vector<std::unique_ptr<EdY>> babies;
+    uint32_t id = File::unique_fingerprint(_plan.fingerprint(), std::to_string(_bs.degree()) + (_bs.dickson() ? "-dickson" : ""));
+    File* file_babies = babies_file(file);
+    if (file_babies != nullptr)
+    {
+        // The table is only valid for this P, so its normalized Y goes into the id.
+        EdY normP(P);
+        normP.normalize();
+        Giant Y, Z;
+        normP.serialize(Y, Z);
+        id = File::unique_fingerprint(id, Y.to_string());
+    }
+    std::unique_ptr<PointTableState> table(read_state<PointTableState>(file_babies));
+    if (table && table->get(id, montgomery, babies) && babies.size() == _plan.residues().size())
+        logging.info("restored %d baby steps.\n", (int)babies.size());
+    else
+    {
+        if (point != nullptr)
+            baby_steps(montgomery, *point, babies);
+        else
+            baby_steps(montgomery, P, babies);
+        if (file_babies != nullptr)
+        {
+            table.reset(new PointTableState());
+            table->set(id, babies);
+            file_babies->write(*table);
+        }
+    }
+    table.reset();
+    for (auto& baby : babies)
+        montgomery.gw().fft(*baby->Y, *baby->Y);
+    EdY DP(montgomery);
+    if (point == nullptr)
+        montgomery.mul(P, (int32_t)_plan.D(), DP);
+
+    std::vector<std::unique_ptr<Stage2Segments::Worker>> workers;
+    for (int i = 0; i < thread_count; i++)
+        workers.emplace_back(new Worker(montgomery, point == nullptr ? &DP : nullptr, point, babies, _plan, _bs, thread_count > 1));
+    Stage2Segments segments(_plan);
+    segments.run(workers, GIANT_BATCH, res, file, logging);
+}
+
+File* MontgomeryStage2::babies_file(File* file)
+{
+    if (file == nullptr)
+        return nullptr;
+    std::string filename = file->filename() + ".babies";
+    for (auto& child : file->children())
+        if (child->filename() == filename)
+            return child.get();
+    return file->add_child("babies", file->fingerprint());
+}
+
+void LucasStage2::poly_mod(Poly& a, Poly& b, Poly& res)
+{
+    PolyMult& pm = b.pm();
+    int nb = b.degree();
+    int q = a.degree() - nb + 1;
+    if (q <= 0)
+    {
+        if (&a != &res)
+            res = a;
+        return;
+    }
+
+    // Quotient from the top coefficients of a and the reciprocal of b, x^(nb + q) div b.
+    Poly quotient(pm);
+    Poly reciprocal(pm, q, true);
+    pm.reciprocal(b, reciprocal, 0);
+    pm.shiftright(a, nb, quotient);
+    pm.mul(quotient, reciprocal, quotient, 0);
+    quotient >>= q;
+
+    Poly tmp(pm);
+    pm.mul_range(quotient, b, tmp, 0, nb, 0);
+    Poly rem(pm, nb, false);
+    for (int i = 0; i < nb; i++)
+        if (i < (int)tmp.size())
+            gwsub3o(pm.gw().gwdata(), a.data()[i], tmp.data()[i], rem.data()[i], GWADD_FORCE_NORMALIZE);
+        else
+            gwcopy(pm.gw().gwdata(), a.data()[i], rem.data()[i]);
+    res = std::move(rem);
+}
+
+void LucasStage2::product_tree(std::vector<std::unique_ptr<Poly>>& leaves, std::vector<std::vector<std::unique_ptr<Poly>>>& tree)
+{
+    tree.clear();
+    tree.emplace_back(std::move(leaves));
+    leaves.clear();
+    while (tree.back().size() > 1)
+    {
+        std::vector<std::unique_ptr<Poly>>& level = tree.back();
+        std::vector<std::unique_ptr<Poly>> next;
+        for (size_t i = 0; i + 1 < level.size(); i += 2)
+        {
+            next.emplace_back(new Poly(level[i]->pm()));
+            level[i]->pm().mul(*level[i], *level[i + 1], *next.back(), 0);
+        }
+        if (level.size() & 1)
+            next.emplace_back(new Poly(*level.back()));
+        tree.emplace_back(std::move(next));
+    }
+}
+
+void LucasStage2::evaluate(Poly& F, std::vector<std::vector<std::unique_ptr<Poly>>>& tree, GWNum& res)
+{
+    GWArithmetic& gw = F.pm().gw();
+    std::vector<std::unique_ptr<Poly>> rems;
+    rems.emplace_back(new Poly(F.pm()));
+    poly_mod(F, *tree.back()[0], *rems[0]);
+    for (int j = (int)tree.size() - 2; j >= 0; j--)
+    {
+        std::vector<std::unique_ptr<Poly>> next;
+        for (size_t i = 0; i < tree[j].size(); i++)
+        {
+            next.emplace_back(new Poly(F.pm()));
+            poly_mod(*rems[i/2], *tree[j][i], *next.back());
+        }
+        rems = std::move(next);
+    }
+    // Remainders modulo X - V_{m*D} are the values of F.
+    for (auto& rem : rems)
+        if (rem->size() == 0)
+            res = 0;
+        else
+        {
+            GWNumWrapper value = rem->at(0);
+            gw.mul(res, value, res, GWMUL_STARTNEXTFFT);
+        }
+}
+
+class LucasStage2::Worker : public Stage2Segments::Worker
+{
+public:
+    // The polymult threads of the caller are split evenly between the workers.
+    // discriminant is V^2 - 4 for the Brent-Suyama extension, nullptr for plain steps.
+    Worker(LucasVArithmetic& lucas, LucasV& V, LucasV& VD, GWNum* discriminant, Poly& F, const Stage2Plan& plan, const BrentSuyama& bs, int workers)
+        : Stage2Segments::Worker(lucas.gw(), workers > 1), _plan(plan), _bs(bs), _lucas(gw(), lucas.negativeQ()), _pm(gw(), std::max(1, lucas.gw().state().thread_count/workers)), _F(_pm), _VD(_lucas, VD.V(), VD.parity()), _cur(_lucas), _next(_lucas)
+    {
+        _pm.set_threads(std::max(1, lucas.gw().state().thread_count/workers));
+        _pm.copy(F, _F);
+        if (discriminant != nullptr)
+        {
+            _uv.reset(new LucasUVArithmetic(gw(), *discriminant));
+            _base.reset(new LucasUV(*_uv));
+            GWNum P(gw());
+            P = V.V();
+            _uv->init(P, *_base);
+        }
+    }
+
+    void start(uint64_t position) override
+    {
+        if (_bs.enabled())
+            differences_init(*_uv, *_base, _bs, (_plan.m_first() + position)*_plan.D(), _plan.D(), _diffs, _table);
+        else
+            ladder(_lucas, _VD, _plan.m_first() + position, _cur, _next);
+    }
+
+    void step(uint64_t position, uint64_t count, GWNum& accumulator) override
+    {
+        std::vector<std::unique_ptr<Poly>> leaves;
+        std::vector<std::vector<std::unique_ptr<Poly>>> tree;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (!_plan.empty(_plan.m_first() + position + i))
+                leaves.emplace_back(root_poly(_pm, _bs.enabled() ? _table[0]->V() : _cur.V()));
+            if (_bs.enabled())
+            {
+                differences_next(*_uv, _diffs, _table);
+                continue;
+            }
+            LucasV tmp(_lucas);
+            _lucas.add(_next, _VD, _cur, tmp);
+            _cur = std::move(_next);
+            _next = std::move(tmp);
+        }
+        if (!leaves.empty())
+        {
+            product_tree(leaves, tree);
+            evaluate(_F, tree, accumulator);
+        }
+    }
+
+private:
+    const Stage2Plan& _plan;
+    const BrentSuyama& _bs;
+    LucasVArithmetic _lucas;
+    PolyMult _pm;
+    Poly _F;
+    LucasV _VD;
+    LucasV _cur;
+    LucasV _next;
+    std::unique_ptr<LucasUVArithmetic> _uv;
+    std::unique_ptr<LucasUV> _base;
+    std::vector<Giant> _diffs;
+    std::vector<std::unique_ptr<LucasUV>> _table;
+};
+
+void LucasStage2::run(LucasVArithmetic& lucas, LucasV& V, GWNum& res, int thread_count, File* file, Logging& logging)
+{
+    if (thread_count < 1)
+        thread_count = 1;
+    if (_bs.enabled() && lucas.negativeQ())
+        throw std::invalid_argument("Brent-Suyama extension is not supported with negative Q.");
+    GWArithmetic& gw = lucas.gw();
+    const std::vector<uint32_t>& residues = _plan.residues();
+    if (gw.state().polymult_safety_margin <= 0)
+        throw std::invalid_argument("P+1 stage 2 needs polymult_safety_margin set before gwstate setup.");
+
+    PolyMult pm(gw, gw.state().thread_count);
+    pm.set_threads(gw.state().thread_count);
+    if (2*(int)residues.size() > pm.max_output())
+        throw std::invalid_argument("Stage 2 polynomials exceed the safe polymult size.");
+
+    // F(X) = prod(X - V_r) over odd multiples r coprime to D, or prod(X - V_f(r)) with the extension.
+    std::vector<std::unique_ptr<Poly>> leaves;
+    std::vector<std::vector<std::unique_ptr<Poly>>> tree;
+    std::unique_ptr<GWNum> discriminant;
+    if (_bs.enabled())
+    {
+        // With P = V and D = V^2 - 4 the LucasUV sequence has the values V_k of the original one, halved.
+        discriminant.reset(new GWNum(gw));
+        *discriminant = square(V.V()) - 4;
+        LucasUVArithmetic uv(gw, *discriminant);
+        LucasUV base(uv);
+        uv.init(V.V(), base);
+        std::vector<Giant> diffs;
+        std::vector<std::unique_ptr<LucasUV>> table;
+        differences_init(uv, base, _bs, 1, 2, diffs, table);
+        for (uint32_t r = 1; leaves.size() < residues.size(); r += 2)
+        {
+            if (residues[leaves.size()] == r)
+                leaves.emplace_back(root_poly(pm, table[0]->V()));
+            if (leaves.size() < residues.size())
+                differences_next(uv, diffs, table);
+        }
+    }
+    else
+    {
+        LucasV prev(V);
+        LucasV V2(lucas);
+        lucas.dbl(prev, V2);
+        LucasV cur(lucas);
+        lucas.add(V2, prev, prev, cur);
+        leaves.emplace_back(root_poly(pm, prev.V()));
+        for (uint32_t r = 3; leaves.size() < residues.size(); r += 2)
+        {
+            if (residues[leaves.size()] == r)
+                leaves.emplace_back(root_poly(pm, cur.V()));
+            LucasV next(lucas);
+            lucas.add(cur, V2, prev, next);
+            prev = std::move(cur);
+            cur = std::move(next);
+        }
+    }
+    product_tree(leaves, tree);
+    Poly F(std::move(*tree.back()[0]));
+    tree.clear();
+
+    LucasV VD(lucas);
+    lucas.mul(V, (int32_t)_plan.D(), VD);
+
+    // Each block of residues.size() giant steps is one product tree of at most the degree of F.
+    std::vector<std::unique_ptr<Stage2Segments::Worker>> workers;
+    for (int i = 0; i < thread_count; i++)
+        workers.emplace_back(new Worker(lucas, V, VD, discriminant.get(), F, _plan, _bs, thread_count));
+    Stage2Segments segments(_plan);
+    segments.run(workers, residues.size(), res, file, logging);
+}
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "task.h"
+#include "montgomery.h"
+#include "lucas.h"
+#include "poly.h"
+
+// Baby-step/giant-step plan for stage 2: every prime B1 < p <= B2 is covered by a slot (m, r), p = m*D +- r, gcd(r, D) = 1, r < D/2.
+// One slot costs one accumulation and covers both m*D + r and m*D - r. The plan is immutable after build() and can be shared across curves.
+class Stage2Plan : public TaskState
+{
+public:
+    static const char TYPE = 11;
+    static int PRIMES_PER_BATCH;
+    static int MAX_MULTIPLIER;
+
+public:
+    Stage2Plan() : TaskState(TYPE) { }
+    // max_memory is the number of baby-step values that fit in memory, costs are in multiplications per operation.
+    Stage2Plan(uint64_t B1, uint64_t B2, int max_memory, double cost_baby = 1.0, double cost_giant = 1.0, double cost_pair = 1.0);
+    Stage2Plan(uint64_t B1, uint64_t B2, uint32_t D);
+
+    bool read(Reader& reader) override;
+    void write(Writer& writer) override;
+
+    // Chooses D minimizing the estimated cost with at most max_memory baby steps.
+    static uint32_t choose_D(uint64_t B1, uint64_t B2, int max_memory, double cost_baby, double cost_giant, double cost_pair);
+    static double estimate_cost(uint64_t B1, uint64_t B2, uint32_t D, double cost_baby, double cost_giant, double cost_pair);
+    static int baby_steps(uint32_t D);
+
+    void build();
+
+    uint64_t B1() const { return _B1; }
+    uint64_t B2() const { return _B2; }
+    uint32_t D() const { return _D; }
+    const std::vector<uint32_t>& residues() const { return _residues; }
+    uint64_t m_first() const { return _m_first; }
+    uint64_t m_last() const { return _m_last; }
+    uint64_t giant_steps() const { return _m_last >= _m_first ? _m_last - _m_first + 1 : 0; }
+    // Bitmap of residue indices used with giant step m.
+    const uint64_t* giant(uint64_t m) const { return _bitmap.data() + (m - _m_first)*_words; }
+    bool pair(uint64_t m, int index) const { return ((giant(m)[index >> 6] >> (index & 63)) & 1) != 0; }
+    bool empty(uint64_t m) const;
+    int words() const { return _words; }
+
+    uint64_t primes() const { return _primes; }
+    uint64_t pairs() const { return _pairs; }
+    uint64_t paired() const { return _paired; }
+    uint64_t multiples() const { return _multiples; }
+    double cost(double cost_baby = 1.0, double cost_giant = 1.0, double cost_pair = 1.0) const { return cost_baby*_D/4 + cost_giant*giant_steps() + cost_pair*_pairs; }
+    uint32_t fingerprint() const;
+
+private:
+    void init(uint64_t B1, uint64_t B2, uint32_t D);
+    void set_pair(uint64_t m, int index) { _bitmap[(m - _m_first)*_words + (index >> 6)] |= 1ULL << (index & 63); }
+    void clear_pair(uint64_t m, int index) { _bitmap[(m - _m_first)*_words + (index >> 6)] &= ~(1ULL << (index & 63)); }
+    void cover_multiples();
+
+private:
+    uint64_t _B1 = 0;
+    uint64_t _B2 = 0;
+    uint32_t _D = 0;
+    std::vector<uint32_t> _residues;
+    std::vector<int> _index;
+    uint64_t _m_first = 0;
+    uint64_t _m_last = 0;
+    int _words = 0;
+    std::vector<uint64_t> _bitmap;
+    uint64_t _primes = 0;
+    uint64_t _pairs = 0;
+    uint64_t _paired = 0;
+    uint64_t _multiples = 0;
+};
+
+// Brent-Suyama extension: baby and giant steps are taken at f(r) and f(m*D), f(x) = x^e or the Dickson polynomial D_e(x, -1).
+// f(m*D) -+ f(r) keeps the factors m*D - r and m*D + r of the plain pairing and adds the other algebraic factors of f(X) -+ f(Y).
+// The steps are walked by finite differences of degree e, which need full group additions.
+class BrentSuyama
+{
+public:
+    BrentSuyama(int degree = 1, bool dickson = false) : _degree(degree < 1 ? 1 : degree), _dickson(dickson) { }
+
+    int degree() const { return _degree; }
+    bool dickson() const { return _dickson; }
+    bool enabled() const { return _degree > 1; }
+
+    void eval(uint64_t x, arithmetic::Giant& res) const;
+    // Forward differences of f at x, x + step, ..., x + degree*step. All coefficients of f are nonnegative, so are the differences.
+    void differences(uint64_t x, uint64_t step, std::vector<arithmetic::Giant>& res) const;
+    // Irreducible factors of f(X) -+ f(Y) besides X - Y and X + Y, counted as the divisors of 2e above 2.
+    int extra_factors() const;
+
+    // Group additions on top of the plain stage 2, one per degree for every baby and giant step.
+    double extra_cost(const Stage2Plan& plan) const { return enabled() ? (double)_degree*(plan.D()/4 + plan.giant_steps()) : 0.0; }
+    // Probability that a factor of factor_bits bits is found only thanks to the extension, with the group order a random integer of size p/torsion.
+    double extra_probability(const Stage2Plan& plan, double factor_bits, double torsion = 12) const;
+    // Probability that the plain stage 2 finds the factor, for comparison.
+    static double probability(const Stage2Plan& plan, double factor_bits, double torsion = 12);
+    static double dickman_rho(double u);
+
+private:
+    int _degree;
+    bool _dickson;
+};
+
+class Stage2State : public TaskState
+{
+public:
+    static const char TYPE = 12;
+
+    struct Segment
+    {
+        uint64_t start;
+        uint64_t end;
+        uint64_t position;
+        arithmetic::Giant accumulator;
+    };
+
+public:
+    Stage2State() : TaskState(TYPE) { }
+    void set(int iteration, uint32_t fingerprint, std::vector<Segment>& segments) { TaskState::set(iteration); _fingerprint = fingerprint; _segments = segments; }
+    bool read(Reader& reader) override;
+    void write(Writer& writer) override;
+
+    // Fingerprint of the plan the segments belong to.
+    uint32_t fingerprint() { return _fingerprint; }
+    std::vector<Segment>& segments() { return _segments; }
+
+private:
+    uint32_t _fingerprint = 0;
+    std::vector<Segment> _segments;
+};
+
+// Table of normalized points in SerializedGWNum records, Y for EdY and X, Y for affine Edwards points.
+// The points are serialized one by one into the writer, id identifies the contents of the table.
+class PointTableState : public TaskState
+{
+public:
+    static const char TYPE = 13;
+
+public:
+    PointTableState() : TaskState(TYPE) { }
+    bool read(Reader& reader) override;
+    void write(Writer& writer) override;
+
+    // The table is referenced until written, all points must be normalized.
+    void set(uint32_t id, std::vector<std::unique_ptr<arithmetic::EdY>>& points);
+    void set(uint32_t id, std::vector<std::unique_ptr<arithmetic::EdPoint>>& points);
+    // Return false if the records do not match id or the point type.
+    bool get(uint32_t id, arithmetic::MontgomeryArithmetic& montgomery, std::vector<std::unique_ptr<arithmetic::EdY>>& points);
+    bool get(uint32_t id, arithmetic::EdwardsArithmetic& ed, std::vector<std::unique_ptr<arithmetic::EdPoint>>& points);
+
+    uint32_t id() { return _id; }
+    size_t size() { return _coordinates > 0 ? _values.size()/_coordinates : 0; }
+
+private:
+    uint32_t _id = 0;
+    uint32_t _coordinates = 0;
+    std::vector<std::unique_ptr<arithmetic::EdY>>* _ed_y = nullptr;
+    std::vector<std::unique_ptr<arithmetic::EdPoint>>* _ed = nullptr;
+    std::vector<arithmetic::SerializedGWNum> _values;
+};
+
+// Deferred gcd of an accumulated product with N. Checks are scheduled to keep the time spent in gcds below 1/ratio of the run,
+// the cost of a gcd is estimated as GCD_MULS*log2(bitlen(N)) multiplications until the first one is measured.
+class DeferredGCD
+{
+public:
+    static double RATIO;
+    static double GCD_MULS;
+    static bool EVERY_CHECKPOINT;
+
+public:
+    // With every_checkpoint a gcd is also taken at every checkpoint.
+    DeferredGCD(arithmetic::Giant& N, bool every_checkpoint = EVERY_CHECKPOINT, double ratio = RATIO);
+
+    // ops is the number of multiplications per worker since the start of the run.
+    bool due(double ops, bool checkpoint);
+    // Returns true if gcd(value, N) is a proper factor of N.
+    bool check(arithmetic::Giant& value);
+
+    const arithmetic::Giant& factor() const { return _factor; }
+    int checks() const { return _checks; }
+    double gcd_time() const { return _gcd_time; }
+
+private:
+    arithmetic::Giant& _N;
+    bool _every_checkpoint;
+    double _ratio;
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::steady_clock::time_point _last;
+    double _gcd_time = -1;
+    int _checks = 0;
+    arithmetic::Giant _factor;
+};
+
+// Splits the giant steps of a plan into segments processed in parallel by workers on GWState clones.
+// An idle worker steals the upper half of the largest remaining segment. Every segment keeps its own position and accumulator in Stage2State.
+class Stage2Segments
+{
+public:
+    class Worker
+    {
+    public:
+        // A single worker runs on gw with its FFT threads, several workers run on single-threaded clones.
+        Worker(arithmetic::GWArithmetic& gw, bool clone);
+        virtual ~Worker() { }
+
+        arithmetic::GWArithmetic& gw() { return _gw_clone ? *_gw_clone : _gw; }
+        arithmetic::GWNum& accumulator() { return *_accumulator; }
+
+        // Positions are giant step indices relative to m_first of the plan.
+        virtual void start(uint64_t position) = 0;
+        virtual void step(uint64_t position, uint64_t count, arithmetic::GWNum& accumulator) = 0;
+
+    private:
+        arithmetic::GWArithmetic& _gw;
+        std::unique_ptr<arithmetic::GWState> _state;
+        std::unique_ptr<arithmetic::GWArithmetic> _gw_clone;
+        std::unique_ptr<arithmetic::GWNum> _accumulator;
+    };
+
+public:
+    Stage2Segments(const Stage2Plan& plan) : _plan(plan) { }
+
+    // Merges the accumulators of all segments into res, rethrows the first exception of a worker.
+    // Stops early if a scheduled gcd of the partial product finds a factor, res still contains it.
+    void run(std::vector<std::unique_ptr<Worker>>& workers, uint64_t batch, arithmetic::GWNum& res, File* file, Logging& logging);
+
+private:
+    struct Segment
+    {
+        uint64_t start;
+        uint64_t end;
+        uint64_t position;
+        uint64_t claimed;
+        int owner;
+        arithmetic::Giant accumulator;
+    };
+
+    Segment* acquire(int worker, uint64_t batch);
+    void work(Worker& worker, int index, uint64_t batch);
+    bool stopped();
+    void save(Stage2State& state);
+
+private:
+    const Stage2Plan& _plan;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Segment> _segments;
+    std::vector<double> _ops;
+    uint64_t _done = 0;
+    int _active = 0;
+    bool _stop = false;
+    bool _found = false;
+    std::exception_ptr _error;
+};
+
+// ECM stage 2 in Y-only Edwards representation. Accumulates the product of y(m*D*P) - y(r*P) over the pairs of the plan,
+// which vanishes modulo p when the order of P modulo p divides m*D + r or m*D - r.
+class MontgomeryStage2
+{
+public:
+    static int GIANT_BATCH;
+
+public:
+    MontgomeryStage2(const Stage2Plan& plan, const BrentSuyama& bs = BrentSuyama()) : _plan(plan), _bs(bs) { }
+
+    // Each of thread_count workers walks its own segments of giant steps, normalizing them in batches and accumulating pairs.
+    // Throws NoInverseException if a normalization hits a factor.
+    void run(arithmetic::MontgomeryArithmetic& montgomery, arithmetic::EdY& P, arithmetic::GWNum& res, int thread_count, File* file, Logging& logging);
+    // The Brent-Suyama extension needs the full point, the steps are converted to Y-only form before accumulation.
+    void run(arithmetic::MontgomeryArithmetic& montgomery, arithmetic::EdPoint& P, arithmetic::GWNum& res, int thread_count, File* file, Logging& logging);
+
+private:
+    class Worker;
+    void baby_steps(arithmetic::MontgomeryArithmetic& montgomery, arithmetic::EdY& P, std::vector<std::unique_ptr<arithmetic::EdY>>& babies);
+    void baby_steps(arithmetic::MontgomeryArithmetic& montgomery, arithmetic::EdPoint& P, std::vector<std::unique_ptr<arithmetic::EdY>>& babies);
+    void run_workers(arithmetic::MontgomeryArithmetic& montgomery, arithmetic::EdY& P, arithmetic::EdPoint* point, arithmetic::GWNum& res, int thread_count, File* file, Logging& logging);
+    // The baby steps are saved to the child file "babies" of the stage 2 checkpoint and reused on restart.
+    File* babies_file(File* file);
+
+private:
+    const Stage2Plan& _plan;
+    BrentSuyama _bs;
+};
+
+// P+1 stage 2. The baby steps V_r are the roots of F(X) = prod(X - V_r), built by a PolyMult product tree.
+// F is evaluated at blocks of giant steps V_{m*D} by a remainder tree, V_{m*D} = V_r modulo p when the order divides m*D + r or m*D - r.
+class LucasStage2
+{
+public:
+    LucasStage2(const Stage2Plan& plan, const BrentSuyama& bs = BrentSuyama()) : _plan(plan), _bs(bs) { }
+
+    // The product of F(V_{m*D}) over all giant steps with pairs is returned in res, the caller gcds it with N once at the end.
+    // With the Brent-Suyama extension the steps are walked in LucasUV form with the discriminant V^2 - 4, negative Q is not supported.
+    // The gwstate must be set up with polymult_safety_margin for products of twice the number of residues.
+    void run(arithmetic::LucasVArithmetic& lucas, arithmetic::LucasV& V, arithmetic::GWNum& res, int thread_count, File* file, Logging& logging);
+
+    // res = a mod b, b is monic.
+    static void poly_mod(arithmetic::Poly& a, arithmetic::Poly& b, arithmetic::Poly& res);
+    static void product_tree(std::vector<std::unique_ptr<arithmetic::Poly>>& leaves, std::vector<std::vector<std::unique_ptr<arithmetic::Poly>>>& tree);
+    // Multiplies res by the values of F at the roots of the leaves of the tree.
+    static void evaluate(arithmetic::Poly& F, std::vector<std::vector<std::unique_ptr<arithmetic::Poly>>>& tree, arithmetic::GWNum& res);
+
+private:
+    class Worker;
+
+private:
+    const Stage2Plan& _plan;
+    BrentSuyama _bs;
+};
@@ -166,12 +166,21 @@ void Task::on_state()
     if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - _last_write).count() >= DISK_WRITE_TIME || abort_flag() || state_save_flag)
     {
         _logging->debug("saving state to disk.\n");
+        FileTransaction transaction;
+        transaction.add(_file);
+        _logging->progress_transaction(transaction);
         _logging->progress().update(progress(), ops());
         _logging->state_save();
         write_state();
         _last_write = std::chrono::system_clock::now();
         _logging->progress().update(progress(), ops());
         _logging->progress_save();
+        if (!transaction.commit())
+        {
+            _logging->warning("failed to save state to disk.\n");
+            if (_state)
+                _state->clear_written();
+        }
     }
     if (abort_flag())
         throw TaskAbortException();
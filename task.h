@@ -30,6 +30,7 @@ public:
     virtual bool read(Reader& reader);
     virtual void write(Writer& writer);
     void set_written() { _written = true; }
+    void clear_written() { _written = false; }
 
     char type() { return _type; }
     char version() { return 0; }
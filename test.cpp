@@ -0,0 +1,493 @@
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include "gwnum.h"
+#include "cpuid.h"
+#include "stage2.h"
+#include "integer.h"
+#include "exception.h"
+#include "batch.h"
+#include "file.h"
+#include "container.h"
+
+using namespace arithmetic;
+
+int failed = 0;
+
+void check(const char* name, bool ok)
+{
+    std::cout << name << (ok ? ": ok" : ": FAILED") << std::endl;
+    if (!ok)
+        failed++;
+}
+
+// Product of y(f(m*D)*P) - y(f(r)*P) over the pairs of the plan, computed point by point.
+Giant naive_stage2(EdwardsArithmetic& ed, MontgomeryArithmetic& montgomery, EdPoint& P, const Stage2Plan& plan, const BrentSuyama& bs)
+{
+    GWNum res(ed.gw());
+    res = 1;
+    for (uint64_t m = plan.m_first(); m <= plan.m_last(); m++)
+        for (int i = 0; i < (int)plan.residues().size(); i++)
+            if (plan.pair(m, i))
+            {
+                Giant fg, fr;
+                bs.eval(m*plan.D(), fg);
+                bs.eval(plan.residues()[i], fr);
+                EdPoint A(ed), B(ed);
+                if (fg == 0)
+                {
+                    GWNum zero(ed.gw()), one(ed.gw());
+                    zero = 0;
+                    one = 1;
+                    ed.init(zero, one, A);
+                }
+                else
+                    ed.mul(P, fg, A);
+                ed.mul(P, fr, B);
+                EdY a(montgomery, A), b(montgomery, B);
+                a.normalize();
+                b.normalize();
+                res *= *a.Y - *b.Y;
+            }
+    Giant g;
+    g = res;
+    return g;
+}
+
+void test_brent_suyama(GWArithmetic& gw)
+{
+    Logging logging(Logging::LEVEL_WARNING);
+    EdwardsArithmetic ed(gw);
+    GWNum d(gw);
+    EdPoint P = ed.gen_curve(11, &d);
+    MontgomeryArithmetic montgomery(gw, d);
+
+    // e = 2 doubles in the baby-step table, e = 3 with m_first = 0 in the giant-step table.
+    for (auto [B1, degree] : { std::pair<uint64_t, int>(120, 2), std::pair<uint64_t, int>(20, 3) })
+    {
+        Stage2Plan plan(B1, 3000, 60);
+        plan.build();
+        BrentSuyama bs(degree);
+        MontgomeryStage2 stage2(plan, bs);
+        GWNum res(gw);
+        Giant g;
+        try
+        {
+            stage2.run(montgomery, P, res, 1, nullptr, logging);
+            g = res;
+        }
+        catch (const NoInverseException&)
+        {
+            g = 0;
+        }
+        check(degree == 2 ? "Brent-Suyama e=2" : "Brent-Suyama e=3, m_first=0", g == naive_stage2(ed, montgomery, P, plan, bs));
+    }
+}
+
+// With ratio 1 and no gcd measured yet, a gcd is due once the multiplications per worker reach GCD_MULS*log2(bitlen(N)).
+void test_deferred_gcd(Giant& N)
+{
+    double gcd_muls = DeferredGCD::GCD_MULS;
+    DeferredGCD::GCD_MULS = 1;
+    DeferredGCD deferred(N, false, 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double threshold = std::log2((double)N.bitlen());
+    check("deferred gcd estimate", !deferred.due(threshold - 0.5, false) && deferred.due(threshold + 0.5, false));
+    DeferredGCD::GCD_MULS = gcd_muls;
+}
+
+void test_lucas_stage2_margin(GWArithmetic& gw)
+{
+    Logging logging(Logging::LEVEL_ERROR);
+    LucasVArithmetic lucas(gw);
+    LucasV V(lucas);
+    GWNum P(gw);
+    P = 7;
+    lucas.init(P, V);
+    Stage2Plan plan(100, 1000, 30);
+    plan.build();
+    LucasStage2 stage2(plan);
+    GWNum res(gw);
+    bool thrown = false;
+    try
+    {
+        stage2.run(lucas, V, res, 1, nullptr, logging);
+    }
+    catch (const std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    check("P+1 stage 2 requires polymult margin", thrown);
+}
+
+void test_prescreen()
+{
+    Logging logging(Logging::LEVEL_ERROR);
+    std::vector<InputNum> inputs(5);
+    inputs[0].parse("2^15-1");
+    inputs[1].parse("3^20+1");
+    inputs[2].parse("4*5^8+1");
+    inputs[3].parse("2^17-1");
+    inputs[4].parse("10^20+39");
+    std::string reason;
+    check("prescreen rejects composites", !inputs[0].prescreen(reason) && !inputs[1].prescreen(reason) && !inputs[2].prescreen(reason));
+    check("prescreen passes primes", inputs[3].prescreen(reason) && inputs[4].prescreen(reason));
+
+    BatchFermat batch;
+    batch.run(inputs, logging);
+    check("batch skips rejected numbers", !batch.prime(0) && !batch.prime(1) && !batch.prime(2) && batch.prime(3) && batch.prime(4) && batch.res64(0).empty());
+}
+
+// Numbers dividing the base are tested with another base.
+void test_batch_base()
+{
+    Logging logging(Logging::LEVEL_ERROR);
+    std::vector<InputNum> inputs(4);
+    inputs[0].parse("5");
+    inputs[1].parse("7");
+    inputs[2].parse("25");
+    inputs[3].parse("2^17-1");
+    BatchFermat batch(5);
+    batch.run(inputs, logging);
+    check("batch base divisible by N", batch.prime(0) && batch.prime(1) && !batch.prime(2) && batch.prime(3));
+}
+
+// Counts the files of the container sharing the data of another file.
+int references(container::FileContainer& container)
+{
+    int res = 0;
+    for (auto& file : container.index())
+        for (auto& other : container.index())
+            if (&file != &other && file.stream == other.stream && file.offset == other.offset && file.size > 0)
+            {
+                res++;
+                break;
+            }
+    return res;
+}
+
+void test_transaction_dedup()
+{
+    for (bool dedup : {false, true})
+    {
+        remove("test_dedup.pk");
+        {
+            container::FileContainer container("test_dedup.pk", true, false);
+            FilePacked root("state", 1, container);
+            File* a = root.add_child("a", 1);
+            File* b = root.add_child("b", 1);
+            FileTransaction transaction;
+            transaction.dedup = dedup;
+            transaction.add(&root);
+            for (File* file : {a, b})
+            {
+                std::unique_ptr<Writer> writer(file->get_writer(1, 0));
+                writer->write((int32_t)5);
+                file->commit_writer(*writer);
+            }
+            transaction.commit();
+        }
+        container::FileContainer container("test_dedup.pk", true, false);
+        check(dedup ? "transaction dedup on" : "transaction dedup off", references(container) == (dedup ? 2 : 0));
+    }
+    remove("test_dedup.pk");
+}
+
+struct StringWriteStream : public container::WriteStream
+{
+    std::string data;
+    bool closed = false;
+    void set_length(int64_t) override { }
+    void write(const char* buffer, size_t count) override { data.append(buffer, count); }
+    void flush() override { }
+    void close() override { closed = true; }
+};
+
+bool file_exists(const std::string& filename)
+{
+    FILE* fd = fopen(filename.data(), "rb");
+    if (fd != nullptr)
+        fclose(fd);
+    return fd != nullptr;
+}
+
+// A file cleared inside a transaction stays until commit().
+void test_transaction_clear()
+{
+    File plain("test_clear", 1);
+    File* child = plain.add_child("child", 1);
+    for (File* file : {&plain, child})
+    {
+        std::unique_ptr<Writer> writer(file->get_writer(1, 0));
+        writer->write((int32_t)5);
+        file->commit_writer(*writer);
+    }
+    {
+        FileTransaction transaction;
+        transaction.add(&plain);
+        std::unique_ptr<Writer> writer(child->get_writer(1, 0));
+        writer->write((int32_t)6);
+        child->commit_writer(*writer);
+        plain.clear();
+        bool staged = file_exists("test_clear") && file_exists("test_clear.md5");
+        check("transaction clear commits", staged && transaction.commit() && !file_exists("test_clear") && !file_exists("test_clear.md5") && file_exists(child->filename()));
+    }
+    {
+        FileTransaction transaction;
+        transaction.add(child);
+        child->clear();
+    }
+    check("transaction clear dropped", file_exists(child->filename()));
+    child->clear();
+
+    remove("test_clear.pk");
+    {
+        container::FileContainer container("test_clear.pk", true, false);
+        FilePacked root("state", 1, container);
+        std::unique_ptr<Writer> writer(((File&)root).get_writer(1, 0));
+        writer->write((int32_t)5);
+        root.commit_writer(*writer);
+        root.free_buffer();
+        bool written = std::unique_ptr<Reader>(root.get_reader()) != nullptr;
+        FileTransaction transaction;
+        transaction.add(&root);
+        root.clear();
+        transaction.commit();
+        root.free_buffer();
+        check("transaction clear packed", written && !std::unique_ptr<Reader>(root.get_reader()));
+    }
+    remove("test_clear.pk");
+}
+
+// Packs files of several writers with repeated contents and unpacks the container fed in uneven chunks.
+void test_unpacker()
+{
+    for (bool dedup : {false, true})
+    {
+        container::MemoryStream packed(false, true);
+        std::map<std::string, std::string> files;
+        {
+            container::Packer packer(&packed);
+            packer.md5 = true;
+            packer.dedup = dedup;
+            for (int w = 0; w < 3; w++)
+            {
+                auto& writer = packer.add_writer();
+                if (w == 1)
+                    writer.add_codec("base64");
+                for (int i = 0; i < 20; i++)
+                {
+                    std::string name = std::to_string(w) + "_" + std::to_string(i);
+                    std::string data((i/2*7919) % 30000 + 1, 'x');
+                    for (size_t j = 0; j < data.size(); j++)
+                        data[j] = (char)((j*j*(i/2 + 1)) >> 3);
+                    writer.add_file(name, data.data(), data.size());
+                    files[name] = data;
+                }
+                writer.close();
+            }
+        }
+        int64_t length = packed.position();
+        std::vector<char> data(packed.data(), packed.data() + length);
+
+        for (int threads = 0; threads <= 3; threads++)
+        {
+            std::map<std::string, std::unique_ptr<StringWriteStream>> outputs;
+            container::Unpacker unpacker([&](container::FileDesc& file) { return (outputs[file.name] = std::make_unique<StringWriteStream>()).get(); }, threads);
+            unpacker.dedup = dedup;
+            bool ok = true;
+            try
+            {
+                for (size_t pos = 0, len = 1; pos < data.size(); pos += len, len = len*7 % 65521 + 1)
+                    unpacker.write(data.data() + pos, std::min(len, data.size() - pos));
+                unpacker.flush();
+                unpacker.close();
+            }
+            catch (const std::exception&)
+            {
+                ok = false;
+            }
+            for (auto& [name, data] : files)
+                ok &= outputs.count(name) > 0 && outputs[name]->closed && outputs[name]->data == data;
+            ok &= unpacker.skipped().empty();
+            std::string name = std::string("unpacker round trip") + (dedup ? " with dedup, " : ", ") + std::to_string(threads) + " threads";
+            check(name.data(), ok);
+        }
+    }
+
+    // A throwing sink fails flush() instead of blocking it.
+    container::MemoryStream packed(false, true);
+    {
+        container::Packer packer(&packed);
+        packer.add_writer().add_file("a", "abc", 3);
+    }
+    container::Unpacker unpacker([](container::FileDesc&) -> container::WriteStream* { throw std::runtime_error("sink"); }, 1);
+    bool thrown = false;
+    try
+    {
+        unpacker.write(packed.data(), (size_t)packed.position());
+        unpacker.flush();
+    }
+    catch (const std::exception&)
+    {
+        thrown = true;
+    }
+    check("unpacker sink error", thrown);
+}
+
+// Reads the files of a container from several threads, then verifies it before and after damaging one of them.
+void test_container_verify()
+{
+    remove("test_verify.pk");
+    std::map<std::string, std::string> files;
+    {
+        container::Packer packer("test_verify.pk");
+        packer.md5 = true;
+        for (int w = 0; w < 2; w++)
+        {
+            auto& writer = packer.add_writer();
+            for (int i = 0; i < 20; i++)
+            {
+                std::string name = std::to_string(w) + "_" + std::to_string(i);
+                std::string data(i*100 + 1, (char)('a' + i));
+                writer.add_file(name, data.data(), data.size());
+                files[name] = data;
+            }
+        }
+    }
+
+    bool ok = true;
+    {
+        container::FileContainer container("test_verify.pk");
+        std::vector<std::thread> threads;
+        std::vector<char> results(4, 1);
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([&, t]()
+            {
+                std::vector<char> buffer;
+                for (auto& [name, data] : files)
+                    if (!container.read_file(name, buffer) || std::string(buffer.begin(), buffer.end()) != data)
+                        results[t] = 0;
+            });
+        for (auto& thread : threads)
+            thread.join();
+        for (char result : results)
+            ok &= result != 0;
+        check("container concurrent reads", ok);
+        check("container verify", container.verify(4) == 0 && container.index().size() == files.size());
+    }
+
+    // Damages the data of one of the two files named *_19.
+    FILE* fd = fopen("test_verify.pk", "r+b");
+    std::string text(1 << 16, 0);
+    text.resize(fread(text.data(), 1, text.size(), fd));
+    size_t offset = text.find(std::string(1901, 't'));
+    fseek(fd, (long)offset + 1000, SEEK_SET);
+    fputc('x', fd);
+    fclose(fd);
+    {
+        container::FileContainer container("test_verify.pk");
+        check("container verify finds damage", offset != std::string::npos && container.verify(4) == 1 && container.index().contains("0_19") != container.index().contains("1_19"));
+    }
+    remove("test_verify.pk");
+}
+
+void test_input_value()
+{
+    InputNum input;
+    input.parse("3*2^10+1");
+    Giant v = input.value();
+    v += 1;
+    check("input value is a copy", input.value() == 3073 && input.value() % 7 == 3073 % 7 && input.gk()*input.gb() == 6);
+    input.init(5, 2, 3, 1);
+    check("input value follows changes", input.value() == 41 && input.bitlen() == 6);
+}
+
+void test_special_form()
+{
+    InputNum kbnc;
+    kbnc.parse("7*2^4000+5");
+    InputNum special;
+    special.parse(kbnc.value().to_string());
+    std::string digits;
+    for (uint64_t i = 0, x = 88172645463325252ULL; i < 2000; i++, x = x*6364136223846793005ULL + 1442695040888963407ULL)
+        digits += (char)('1' + (x >> 33)%9);
+    InputNum generic;
+    generic.parse(digits);
+    check("special form of generic input", special.find_special_form() && special.special_form_text() == "(7*2^4002+20)/4" && !generic.find_special_form());
+}
+
+// Record of 3*2^10+1 in the version 1 layout of InputNum::write with N and version given.
+void write_input_record(File& file, const Giant& N, char version)
+{
+    Giant k, b, d;
+    k = 3;
+    b = 2;
+    d = 1;
+    std::unique_ptr<Writer> writer(file.get_writer(0, version));
+    writer->write(N);
+    writer->write((int32_t)InputNum::KBNC);
+    writer->write(k);
+    writer->write(b);
+    writer->write((uint32_t)10);
+    writer->write(d);
+    writer->write((int32_t)1);
+    writer->write((int32_t)0);
+    for (int i = 0; i < 5; i++)
+        writer->write(std::string("3*2^10+1"));
+    for (int i = 0; i < 4; i++)
+        writer->write((int32_t)0);
+    for (int i = 0; i < 3; i++)
+        writer->write((int32_t)0);
+    file.commit_writer(*writer);
+}
+
+void test_input_checkpoint()
+{
+    File file("test_input.ckpt", 1);
+    InputNum input;
+    input.parse("3*2^10+1");
+    input.write(file);
+    InputNum restored;
+    check("input checkpoint round trip", restored.read(file) && restored.value() == input.value() && restored.n() == 10);
+
+    Giant N;
+    N = input.value();
+    write_input_record(file, N, 1);
+    check("input checkpoint layout", restored.read(file));
+    write_input_record(file, N, 2);
+    check("input checkpoint rejects unknown version", !restored.read(file) && restored.value() == input.value());
+    N += 2;
+    write_input_record(file, N, 1);
+    check("input checkpoint rejects other number", !restored.read(file) && restored.value() == input.value());
+    file.clear();
+}
+
+int main()
+{
+    Giant N;
+    N = "170141183460469231731687303715884105727";
+    N *= 16777259;
+    GWState gwstate;
+    gwstate.maxmulbyconst = 1000;
+    gwstate.setup(N);
+    GWArithmetic gw(gwstate);
+
+    test_brent_suyama(gw);
+    test_deferred_gcd(N);
+    test_lucas_stage2_margin(gw);
+    test_prescreen();
+    test_batch_base();
+    test_transaction_dedup();
+    test_transaction_clear();
+    test_unpacker();
+    test_container_verify();
+    test_input_value();
+    test_special_form();
+    test_input_checkpoint();
+
+    std::cout << (failed == 0 ? "all tests passed" : "some tests failed") << std::endl;
+    return failed == 0 ? 0 : 1;
+}